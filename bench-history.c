@@ -0,0 +1,255 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Benchmarks for adding lines to a full history, comparing hist_add() with
+ * a stifled Readline history, and for incremental and fuzzy search and
+ * autosuggestions.  Build it with "make bench-history". */
+
+#include "with-readline.h"
+
+#define BENCH_LINES 20000               /* lines added per measurement */
+
+/* add lines to a full history of size entries and return the average time
+ * per line in nanoseconds, and set *worst to the longest a line took.
+ * Enough lines are added to fill the slack, so the time includes removing
+ * old entries. */
+static double measure(long size, int stifled, double *worst) {
+  struct timespec start, end, before, after;
+  char buf[64];
+  double ns;
+  long n, lines = stifled && size > 10000 ? 2000
+    : size + HISTORY_SLACK(size) + BENCH_LINES;
+
+  if(stifled)
+    stifle_history(size);
+  for(n = 0; n < size; ++n) {
+    sprintf(buf, "prefill %ld", n);
+    add_history(buf);
+  }
+  if(!stifled) {
+    hist_index();
+    hist_limit(size);
+  }
+  *worst = 0;
+  monotonic(&start);
+  for(n = 0; n < lines; ++n) {
+    sprintf(buf, "line %ld", n);
+    monotonic(&before);
+    if(stifled)
+      add_history(buf);
+    else
+      hist_add(buf);
+    monotonic(&after);
+    ns = (after.tv_sec - before.tv_sec) * 1e9
+      + (after.tv_nsec - before.tv_nsec);
+    if(ns > *worst)
+      *worst = ns;
+  }
+  monotonic(&end);
+  return ((end.tv_sec - start.tv_sec) * 1e9
+          + (end.tv_nsec - start.tv_nsec)) / lines;
+}
+
+/* fill the history with size lines that look a bit like commands */
+static void fill(long size) {
+  static const char *const formats[] = {
+    "git commit -m 'fix %ld'",
+    "make -j%ld check",
+    "ls -l /usr/src/linux-%ld",
+    "ssh build%ld.example.com uptime",
+    "grep -r pattern%ld src/",
+    0
+  };
+  char buf[128];
+  long n;
+
+  hist_index();
+  hist_limit(size);
+  for(n = 0; n < size; ++n) {
+    sprintf(buf, formats[n % 5], n * 7919 % size);
+    hist_add(buf);
+  }
+}
+
+/* type query into a search of a history of size entries; return the
+ * longest a keystroke took, in nanoseconds */
+static double measure_search(long size, const char *query) {
+  struct timespec start, end;
+  double ns, worst = 0;
+  const char *q;
+
+  fill(size);
+  search_begin();                       /* build the index */
+  for(q = query; *q; ++q) {
+    monotonic(&start);
+    search_narrow((unsigned char)*q, -1);
+    monotonic(&end);
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    if(ns > worst)
+      worst = ns;
+  }
+  /* and a few more matches */
+  for(q = query; *q; ++q) {
+    monotonic(&start);
+    search_next(-1);
+    monotonic(&end);
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    if(ns > worst)
+      worst = ns;
+  }
+  return worst;
+}
+
+/* type query into the fuzzy picker over a history of size entries; return
+ * the longest a keystroke took, in nanoseconds */
+static double measure_fuzzy(long size, const char *query) {
+  struct timespec start, end;
+  double ns, worst = 0;
+  const char *q;
+
+  fill(size);
+  fuzzy_begin();
+  for(q = query; *q; ++q) {
+    monotonic(&start);
+    fuzzy_narrow((unsigned char)*q);
+    monotonic(&end);
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    if(ns > worst)
+      worst = ns;
+  }
+  return worst;
+}
+
+/* look up autosuggestions for each prefix of query in a history of size
+ * entries; return the longest a lookup took, in nanoseconds */
+static double measure_suggest(long size, const char *query) {
+  struct timespec start, end;
+  double ns, worst = 0;
+  char buf[128];
+  size_t n;
+
+  suggest_start();
+  fill(size);
+  for(n = 1; query[n - 1]; ++n) {
+    memcpy(buf, query, n);
+    buf[n] = 0;
+    monotonic(&start);
+    suggest_lookup(buf);
+    monotonic(&end);
+    ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    if(ns > worst)
+      worst = ns;
+  }
+  return worst;
+}
+
+/* run f(size, arg, &extra) in a fresh process and return its result,
+ * setting *extra too if it's not a null pointer */
+static double run(double (*f)(long, const void *, double *), long size,
+                  const void *arg, double *extra) {
+  int p[2];
+  double ns[2];
+  pid_t pid;
+
+  /* each measurement gets a fresh process, and therefore history */
+  fflush(stdout);
+  if(pipe(p) < 0) fatal(errno, "error creating pipe");
+  if(!(pid = fork())) {
+    ns[1] = 0;
+    ns[0] = f(size, arg, &ns[1]);
+    _exit(do_writen(p[1], (char *)ns, sizeof ns));
+  }
+  if(pid < 0) fatal(errno, "error calling fork");
+  xclose(p[1]);
+  if(do_readn(p[0], ns, sizeof ns))
+    fatal(0, "measurement failed");
+  xclose(p[0]);
+  waitpid(pid, 0, 0);
+  if(extra)
+    *extra = ns[1];
+  return ns[0];
+}
+
+static double run_add(long size, const void *stifled, double *worst) {
+  return measure(size, *(const int *)stifled, worst);
+}
+
+static double run_search(long size, const void *query,
+                         double attribute((unused)) *extra) {
+  return measure_search(size, query);
+}
+
+static double run_fuzzy(long size, const void *query,
+                        double attribute((unused)) *extra) {
+  return measure_fuzzy(size, query);
+}
+
+static double run_suggest(long size, const void *query,
+                          double attribute((unused)) *extra) {
+  return measure_suggest(size, query);
+}
+
+int main(void) {
+  static const long sizes[] = { 1000, 10000, 100000, 1000000, 0 };
+  static const char *const queries[] = {
+    "git commit", "build1234", "/usr/src/linux-99", "nowhere", 0
+  };
+  static const char *const fuzzy[] = {
+    "gcm", "bld1234", "lnx99", "qqq", 0
+  };
+  double worst;
+  int n, q, stifled;
+
+  printf("%10s %14s %14s %14s %14s\n", "entries", "stifled ns",
+         "worst ns", "hist_add ns", "worst ns");
+  for(n = 0; sizes[n]; ++n) {
+    printf("%10ld", sizes[n]);
+    for(stifled = 1; stifled >= 0; --stifled) {
+      printf(" %14.1f", run(run_add, sizes[n], &stifled, &worst));
+      printf(" %14.1f", worst);
+    }
+    putchar('\n');
+  }
+  printf("\n%10s %-20s %14s\n", "entries", "search", "worst key ns");
+  for(n = 0; sizes[n]; ++n)
+    for(q = 0; queries[q]; ++q)
+      printf("%10ld %-20s %14.1f\n", sizes[n], queries[q],
+             run(run_search, sizes[n], queries[q], 0));
+  printf("\n%10s %-20s %14s\n", "entries", "fuzzy", "worst key ns");
+  for(n = 0; sizes[n]; ++n)
+    for(q = 0; fuzzy[q]; ++q)
+      printf("%10ld %-20s %14.1f\n", sizes[n], fuzzy[q],
+             run(run_fuzzy, sizes[n], fuzzy[q], 0));
+  printf("\n%10s %-20s %14s\n", "entries", "suggest", "worst key ns");
+  for(n = 0; sizes[n]; ++n)
+    for(q = 0; queries[q]; ++q)
+      printf("%10ld %-20s %14.1f\n", sizes[n], queries[q],
+             run(run_suggest, sizes[n], queries[q], 0));
+  return 0;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
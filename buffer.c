@@ -42,7 +42,7 @@ void buffer_append(struct buffer *b, const void *ptr, size_t n) {
       while(ns && ns < n + len)
 	ns *= 2;
       if(!ns) fatal(0, "insufficient memory");
-      if(!(nb = realloc(b->start, ns)))
+      if(!(nb = realloc(b->base, ns)))
 	fatal(errno, "error calling realloc");
       memmove(nb, nb + offset, len);
       b->base = b->start = nb;
@@ -68,6 +68,12 @@ void buffer_clear(struct buffer *b) {
   b->start = b->end = b->base;
 }
 
+/* discard all but the last n bytes */
+void buffer_keep(struct buffer *b, size_t n) {
+  if((size_t)(b->end - b->start) > n)
+    b->start = b->end - n;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
@@ -0,0 +1,99 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Check that a history file can be loaded and appended to through the
+ * history daemon.  Run by "make check". */
+
+#include "with-readline.h"
+
+#define CHECK_PATIENCE 5000             /* ms to wait for the append */
+
+/* stop the daemon listening at socket, so it doesn't outlive the check */
+static void stop(const char *socket) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+  int fd;
+
+  if((fd = unix_connect(socket)) < 0)
+    return;
+  if(!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    kill(cred.pid, SIGTERM);
+  close(fd);
+#endif
+  unlink(socket);
+}
+
+int main(void) {
+  char dir[64], path[128], socket[128], *contents;
+  const char *expect = "#100\nfirst\nsecond\n#200\nthird\n";
+  struct timespec start;
+  size_t n = 1;
+  FILE *fp;
+
+  strcpy(dir, "/tmp/check-histd.XXXXXX");
+  if(!mkdtemp(dir))
+    fatal(errno, "error calling mkdtemp");
+  setenv("XDG_RUNTIME_DIR", dir, 1);
+  sprintf(path, "%s/history", dir);
+  sprintf(socket, "%s/with-readline/histd", dir);
+  if(!(fp = fopen(path, "w")))
+    fatal(errno, "error opening %s", path);
+  fputs("#100\nfirst\nsecond\n", fp);
+  xfclose(fp);
+  if(!histd_load(path, 100))
+    fatal(0, "histd_load failed");
+  if(history_length != 2)
+    fatal(0, "history_length is %d", history_length);
+  if(strcmp(history_list()[0]->line, "first")
+     || strcmp(history_list()[0]->timestamp, "#100")
+     || strcmp(history_list()[1]->line, "second"))
+    fatal(0, "wrong history loaded");
+  if(histd_append("#200", "third"))
+    fatal(0, "histd_append failed");
+  /* the daemon appends to the file when it gets round to it */
+  contents = xmalloc(n);
+  monotonic(&start);
+  do {
+    usleep(10000);
+    if(!(fp = fopen(path, "r")))
+      fatal(errno, "error opening %s", path);
+    if(getdelim(&contents, &n, 0, fp) < 0)
+      contents[0] = 0;
+    fclose(fp);
+  } while(strcmp(contents, expect) && ms_since(&start) < CHECK_PATIENCE);
+  stop(socket);
+  unlink(path);
+  sprintf(path, "%s/with-readline", dir);
+  rmdir(path);
+  rmdir(dir);
+  if(strcmp(contents, expect))
+    fatal(0, "history file contains:\n%s", contents);
+  return 0;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
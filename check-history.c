@@ -0,0 +1,76 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* Check that a compressed history much bigger than the decoder's chunk
+ * size loads, keeping the right entries.  Run by "make check". */
+
+#include "with-readline.h"
+
+#define CHECK_RECORDS 5000              /* about 320KB decompressed */
+#define CHECK_MAX 500
+
+int main(void) {
+#if HAVE_ZLIB_H
+  struct buffer text, z;
+  char buf[128], path[64];
+  long entries, n, limit = CHECK_MAX + HISTORY_SLACK(CHECK_MAX) + 1;
+  int fd, err;
+
+  buffer_init(&text);
+  for(n = 0; n < CHECK_RECORDS; ++n) {
+    sprintf(buf, "#%ld 12\nselect * from table%ld where x = %ld;\n",
+            1700000000 + n, n, n * 7);
+    buffer_append(&text, buf, strlen(buf));
+  }
+  buffer_init(&z);
+  history_encode(text.start, text.end - text.start, &z);
+  strcpy(path, "/tmp/check-history.XXXXXX");
+  if((fd = mkstemp(path)) < 0)
+    fatal(errno, "error calling mkstemp");
+  if((err = do_writen(fd, z.start, z.end - z.start)))
+    fatal(err, "error writing %s", path);
+  xclose(fd);
+  entries = history_load(path, CHECK_MAX);
+  unlink(path);
+  if(entries != (CHECK_RECORDS < limit ? CHECK_RECORDS : limit))
+    fatal(0, "%ld entries", entries);
+  if(history_length != CHECK_MAX)
+    fatal(0, "history_length is %d", history_length);
+  sprintf(buf, "select * from table%d where x = %d;",
+          CHECK_RECORDS - 1, (CHECK_RECORDS - 1) * 7);
+  if(strcmp(history_list()[CHECK_MAX - 1]->line, buf))
+    fatal(0, "last entry is %s", history_list()[CHECK_MAX - 1]->line);
+  sprintf(buf, "#%d 12", 1700000000 + CHECK_RECORDS - CHECK_MAX);
+  if(strcmp(history_list()[0]->timestamp, buf))
+    fatal(0, "first timestamp is %s", history_list()[0]->timestamp);
+  return 0;
+#else
+  return 77;                            /* skipped */
+#endif
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,79 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Called in a freshly forked child.  Makes ptspath the controlling terminal
+ * and standard input, output and error, with window size *w and the terminal
+ * settings *t (less echo).  The caller is left to close anything else it
+ * doesn't want the command to inherit. */
+void setup_child(const char *ptspath, const struct termios *t,
+                 const struct winsize *w) {
+  int pts;
+  struct stat sb;
+  struct group *g;
+  mode_t modemask;
+  struct termios child_termios;
+
+  exitfn = _exit;
+  if(setsid() < 0)
+    fatal(errno, "error calling setsid");
+  if((pts = open(ptspath, O_RDWR, 0)) < 0)
+    fatal(errno, "opening %s", ptspath);
+#ifdef TIOCSCTTY
+  if(ioctl(pts, TIOCSCTTY) < 0)
+    fatal(errno, "error calling ioctl TIOCSCTTY");
+#endif
+  /* check that the terminal has sensible permissions */
+  if(fstat(pts, &sb) < 0) fatal(errno, "error calling fstat on %s",
+                                ptspath);
+  /* group tty write is ok - used by write(1) and similar programs
+   * group anything else write is not safe however.
+   * group read is bad - shoulnd't give those programs excess privilege
+   * world read or write is very bad!
+   */
+  if((g = getgrnam("tty")) && sb.st_gid == g->gr_gid) modemask = 057;
+  else modemask = 077;
+  if(sb.st_mode & modemask)
+    fatal(0, "%s has insecure mode %#lo",
+          ptspath, (unsigned long)sb.st_mode);
+  if(sb.st_uid != getuid())
+    fatal(0, "%s has owner %lu, but we are running as UID %lu",
+          ptspath, (unsigned long)sb.st_uid, (unsigned long)getuid());
+  if(pts != 0 && dup2(pts, 0) < 0) fatal(errno, "error calling dup2");
+  if(pts != 1 && dup2(pts, 1) < 0) fatal(errno, "error calling dup2");
+  if(pts != 2 && dup2(pts, 2) < 0) fatal(errno, "error calling dup2");
+  if(pts > 2) xclose(pts);
+  if(ioctl(0, TIOCSWINSZ, w) < 0)
+    fatal(errno, "error calling ioctl TIOSGWINSZ");
+  child_termios = *t;
+  child_termios.c_lflag &= ~ECHO;
+  if(tcsetattr(0, TCSANOW, &child_termios) < 0)
+    fatal(errno, "error calling tcsetattr");
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,210 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#include <sys/mman.h>
+
+/* History file compaction.
+ *
+ * A detached process writes the records worth keeping to a temporary file
+ * and renames it over the history file, so the history file is always
+ * either the old version or the new one.  Nothing is locked while the
+ * temporary file is written.  Only then does the compactor take an
+ * exclusive flock() on the history file, copy across anything appended
+ * since it started, and do the rename.
+ *
+ * Writers take a shared lock while appending.  If they find that the file
+ * they opened has been renamed away by the time they get the lock, they
+ * open it again.
+ */
+
+struct rec {
+  const char *start;                    /* record, including timestamp */
+  size_t len;                           /* ...and its newline */
+  const char *line;                     /* the line itself */
+  size_t linelen;
+};
+
+/* Open path for appending a record, holding a shared lock.  Returns an fd
+ * or -1 with errno set. */
+int history_open_append(const char *path) {
+  struct stat fsb, psb;
+  int fd, tries, err;
+
+  for(tries = 0; tries < 10; ++tries) {
+    if((fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0600)) < 0)
+      return -1;
+    while(flock(fd, LOCK_SH) < 0)
+      if(errno != EINTR) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+      }
+    if(fstat(fd, &fsb) == 0 && stat(path, &psb) == 0
+       && fsb.st_dev == psb.st_dev && fsb.st_ino == psb.st_ino)
+      return fd;
+    close(fd);                          /* replaced while we waited */
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+/* true if r's line is one we've already kept; otherwise remember it */
+static int kept_already(const struct rec **table, size_t nslots,
+                        const struct rec *r) {
+  size_t i = hash_string(14695981039346656037ULL, r->line, r->linelen)
+    % nslots;
+
+  for(; table[i]; i = (i + 1) % nslots)
+    if(table[i]->linelen == r->linelen
+       && !memcmp(table[i]->line, r->line, r->linelen))
+      return 1;
+  table[i] = r;
+  return 0;
+}
+
+/* Lock out writers, copy across anything appended to fd since snapshot,
+ * and rename tmp over path.  Returns 0 or an errno value. */
+static int swap(int fd, const struct stat *sb, off_t snapshot,
+                int tfd, const char *tmp, const char *path) {
+  struct stat now;
+  char buf[4096];
+  ssize_t r;
+  int err;
+
+  while(flock(fd, LOCK_EX) < 0)
+    if(errno != EINTR)
+      return errno;
+  /* if someone else compacted the file while we were working, leave it to
+   * them */
+  if(stat(path, &now) < 0 || now.st_dev != sb->st_dev
+     || now.st_ino != sb->st_ino)
+    return ESTALE;
+  while((r = pread(fd, buf, sizeof buf, snapshot)) != 0) {
+    if(r < 0) {
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    if((err = do_writen(tfd, buf, r)))
+      return err;
+    snapshot += r;
+  }
+  if(fsync(tfd) < 0 || rename(tmp, path) < 0)
+    return errno;
+  return 0;                             /* exiting drops the lock */
+}
+
+/* rewrite path with just its last max records */
+static void compact(const char *path, long max, int erasedups) {
+  struct stat sb;
+  const char *map, *base, *end, *s, *e, *ts = 0;
+  const struct rec **table = 0;
+  struct rec *recs = 0, **keep;
+  size_t nrecs = 0, nslots = 0, nkeep = 0, n;
+  struct buffer text, out, z;
+  off_t snapshot;
+  char *tmp;
+  int fd, tfd;
+
+  if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0 || !sb.st_size)
+    return;
+  if((map = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+     == MAP_FAILED)
+    return;
+  if(history_plain(map, sb.st_size)) {
+    base = map;
+    end = map + sb.st_size;
+    snapshot = sb.st_size;              /* until the last line is found */
+  } else {
+    /* compressed, so work on the text, leaving out any incomplete member
+     * at the end */
+    buffer_init(&text);
+    snapshot = history_decode_text(map, sb.st_size, &text);
+    base = text.start;
+    end = text.end;
+  }
+  /* split into records, leaving out any incomplete line at the end */
+  for(s = base; (e = memchr(s, '\n', end - s)); s = e + 1) {
+    if(e - s > 1 && s[0] == '#' && s[1] >= '0' && s[1] <= '9') {
+      ts = s;
+      continue;
+    }
+    if(e > s) {
+      if(nrecs == nslots) {
+        nslots = nslots ? 2 * nslots : 1024;
+        recs = xrealloc(recs, nslots * sizeof *recs);
+      }
+      recs[nrecs].start = ts ? ts : s;
+      recs[nrecs].len = e + 1 - recs[nrecs].start;
+      recs[nrecs].line = s;
+      recs[nrecs++].linelen = e - s;
+    }
+    ts = 0;
+  }
+  /* pick the records to keep, newest first */
+  keep = xmalloc((max ? max : 1) * sizeof *keep);
+  if(erasedups) {
+    nslots = 2 * (size_t)max + 1;
+    table = xmalloc(nslots * sizeof *table);
+    memset(table, 0, nslots * sizeof *table);
+  }
+  for(n = nrecs; n-- > 0 && nkeep < (size_t)max;)
+    if(!erasedups || !kept_already(table, nslots, &recs[n]))
+      keep[nkeep++] = &recs[n];
+  buffer_init(&out);
+  while(nkeep--)
+    buffer_append(&out, keep[nkeep]->start, keep[nkeep]->len);
+  if(history_compress) {
+    buffer_init(&z);
+    history_encode(out.start, out.end - out.start, &z);
+    free(out.base);
+    out = z;
+  }
+  if(base == map)
+    snapshot = s - base;
+  tmp = xmalloc(strlen(path) + 32);
+  sprintf(tmp, "%s.compact.%lu", path, (unsigned long)getpid());
+  if((tfd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0)
+    return;
+  fchmod(tfd, sb.st_mode & 07777);
+  if(do_writen(tfd, out.start, out.end - out.start)
+     || swap(fd, &sb, snapshot, tfd, tmp, path))
+    unlink(tmp);
+  close(tfd);
+}
+
+/* Trim path down to its last max records (keeping only the latest of any
+ * identical lines if erasedups is set), in the background. */
+void compact_start(const char *path, long max, int erasedups) {
+  if(!daemonize()) {
+    compact(path, max, erasedups);
+    _exit(0);
+  }
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
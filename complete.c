@@ -0,0 +1,475 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#include <ctype.h>
+
+/* Completion from the command's output.
+ *
+ * Words the command prints (table names, identifiers, paths and so on) are
+ * picked out of its output as it passes through and counted in a radix
+ * tree, as in suggest.c.  Words are runs of letters, digits and "_./-"
+ * containing at least one letter; terminal escape sequences are skipped.
+ * The tokenizer keeps its state between calls, so words split across reads
+ * are still seen whole, and looks at each byte once.  Words already known
+ * are found through a hash table, as in hist.c, rather than by walking the
+ * tree, since most words in any quantity of output are repeats.  New words
+ * are added by walking the tree, finding each node's children through a
+ * second hash table keyed by the parent and the child's first byte rather
+ * than by searching the list of siblings.
+ *
+ * The tree is limited to COMPLETE_MEMORY bytes.  When it gets there every
+ * count is halved and words whose count reaches 0 are dropped, until it's
+ * down to three quarters of that; so words seen once go first, and words
+ * seen often survive a long time.
+ *
+ * Completion offers the words starting with what has been typed, most often
+ * seen first, followed by any from the application's dictionary (see
+ * words.c) that haven't been seen, up to COMPLETE_LIST of them.  If there
+ * aren't any, filenames are completed as usual.
+ */
+
+#define COMPLETE_MIN 3                  /* shortest word kept */
+#define COMPLETE_MAX 64                 /* longest word kept */
+#define COMPLETE_MEMORY (4 << 20)       /* most memory used for words */
+#define COMPLETE_BUCKETS_MIN 1024
+#define COMPLETE_LIST 200               /* most matches listed */
+
+struct node {
+  struct node *parent, *child, *sibling;
+  struct node *next;                    /* in hash bucket, if a word */
+  struct node *chain;                   /* in edge hash bucket */
+  uint64_t hash;                        /* hash of word */
+  unsigned long count;                  /* times seen, or 0 if not a word */
+  size_t len;                           /* length of label */
+  char label[];                         /* bytes from parent to here */
+};
+
+static struct node *root;
+static size_t memory;                   /* bytes used for words */
+static struct node **buckets;           /* words by hash */
+static size_t nbuckets, nwords;
+static struct node **edges;             /* nodes by parent and first byte */
+static size_t nedges, nnodes;
+static int enabled;                     /* set if completion is wanted */
+
+/* 1 for bytes that can be part of a word, 2 for those that make it one */
+static unsigned char word_char[256];
+
+static enum {
+  TEXT,                                 /* ordinary output */
+  ESCAPE,                               /* after ESC */
+  CSI,                                  /* in ESC [ ... */
+  OSC                                   /* in ESC ] ... */
+} state;
+static char word[COMPLETE_MAX];         /* word so far */
+static size_t wordlen;                  /* its length, or more if too long */
+static int wordy;                       /* word has a letter in */
+
+/* the edge bucket for parent's child starting with ch */
+static size_t edge(const struct node *parent, int ch) {
+  return ((uint64_t)(uintptr_t)parent * 256 + (unsigned char)ch)
+    * 0x9E3779B97F4A7C15ULL >> 32 & (nedges - 1);
+}
+
+/* return parent's child starting with ch, or a null pointer */
+static struct node *child(const struct node *parent, int ch) {
+  struct node *c;
+
+  for(c = edges[edge(parent, ch)];
+      c && !(c->parent == parent && c->label[0] == ch); c = c->chain)
+    ;
+  return c;
+}
+
+static void add_edge(struct node *n) {
+  size_t e = edge(n->parent, n->label[0]);
+
+  n->chain = edges[e];
+  edges[e] = n;
+}
+
+static void remove_edge(struct node *n) {
+  struct node **np;
+
+  for(np = &edges[edge(n->parent, n->label[0])]; *np != n;
+      np = &(*np)->chain)
+    ;
+  *np = n->chain;
+}
+
+static void grow_edges(void) {
+  struct node **old = edges, *n, *next;
+  size_t oldn = nedges, i;
+
+  nedges = nedges ? 2 * nedges : COMPLETE_BUCKETS_MIN;
+  edges = xmalloc(nedges * sizeof *edges);
+  memset(edges, 0, nedges * sizeof *edges);
+  memory += (nedges - oldn) * sizeof *edges;
+  for(i = 0; i < oldn; ++i)
+    for(n = old[i]; n; n = next) {
+      next = n->chain;
+      add_edge(n);
+    }
+  free(old);
+}
+
+static struct node *new_node(struct node *parent, const char *label,
+                             size_t len) {
+  struct node *n = xmalloc(sizeof *n + len);
+
+  if(nnodes >= nedges)
+    grow_edges();
+  memset(n, 0, sizeof *n);
+  memcpy(n->label, label, len);
+  n->len = len;
+  n->parent = parent;
+  n->sibling = parent->child;
+  parent->child = n;
+  add_edge(n);
+  ++nnodes;
+  memory += sizeof *n + len;
+  return n;
+}
+
+/* return the node for s[0..len), creating it if necessary */
+static struct node *insert(const char *s, size_t len) {
+  struct node *n = root, *c, *mid, **np;
+  size_t i;
+
+  while(len) {
+    if(!(c = child(n, *s)))
+      return new_node(n, s, len);
+    for(i = 1; i < c->len && i < len && s[i] == c->label[i]; ++i)
+      ;
+    if(i < c->len) {
+      /* split c's label */
+      remove_edge(c);
+      mid = new_node(n, c->label, i);
+      for(np = &n->child; *np != c; np = &(*np)->sibling)
+        ;
+      *np = c->sibling;
+      c->parent = mid;
+      c->sibling = 0;
+      mid->child = c;
+      memmove(c->label, c->label + i, c->len - i);
+      c->len -= i;
+      add_edge(c);
+      memory -= i;
+      c = mid;
+    }
+    n = c;
+    s += i;
+    len -= i;
+  }
+  return n;
+}
+
+static struct node **find_word(uint64_t hash) {
+  struct node **np;
+
+  for(np = &buckets[hash % nbuckets]; *np && (*np)->hash != hash;
+      np = &(*np)->next)
+    ;
+  return np;
+}
+
+static void grow_table(void) {
+  struct node **old = buckets, *n, *next;
+  size_t oldn = nbuckets, i;
+
+  nbuckets = nbuckets ? 2 * nbuckets : COMPLETE_BUCKETS_MIN;
+  buckets = xmalloc(nbuckets * sizeof *buckets);
+  memset(buckets, 0, nbuckets * sizeof *buckets);
+  memory += (nbuckets - oldn) * sizeof *buckets;
+  for(i = 0; i < oldn; ++i)
+    for(n = old[i]; n; n = next) {
+      next = n->next;
+      n->next = buckets[n->hash % nbuckets];
+      buckets[n->hash % nbuckets] = n;
+    }
+  free(old);
+}
+
+/* count one sighting of s[0..len) */
+static void count_word(const char *s, size_t len) {
+  uint64_t hash = hash_string(14695981039346656037ULL, s, len);
+  struct node **np, *n;
+
+  if(nwords >= nbuckets)
+    grow_table();
+  if((n = *(np = find_word(hash)))) {
+    ++n->count;
+    return;
+  }
+  n = insert(s, len);
+  n->count = 1;
+  n->hash = hash;
+  n->next = 0;
+  *np = n;
+  ++nwords;
+}
+
+/* halve the counts under n, dropping words that reach 0 */
+static void decay(struct node *n) {
+  struct node **np = &n->child, *c;
+
+  if(n->count && !(n->count /= 2)) {
+    *find_word(n->hash) = n->next;
+    --nwords;
+  }
+  while((c = *np)) {
+    decay(c);
+    if(!c->count && !c->child) {
+      *np = c->sibling;
+      remove_edge(c);
+      --nnodes;
+      memory -= sizeof *c + c->len;
+      free(c);
+    } else
+      np = &c->sibling;
+  }
+}
+
+/* count the word collected so far, if it's one worth keeping */
+static void end_word(void) {
+  size_t len = wordlen;
+
+  /* an overlong word wasn't kept, only counted */
+  if(len <= COMPLETE_MAX) {
+    /* full stops and dashes at the end are more likely punctuation */
+    while(len && (word[len - 1] == '.' || word[len - 1] == '-'))
+      --len;
+    if(wordy && len >= COMPLETE_MIN) {
+      count_word(word, len);
+      if(memory > COMPLETE_MEMORY)
+        while(memory > COMPLETE_MEMORY / 4 * 3 && root->child)
+          decay(root);
+    }
+  }
+  wordlen = 0;
+  wordy = 0;
+}
+
+/* Pick words out of output from the command, buf[0..n). */
+void complete_feed(const char *buf, size_t n) {
+  const unsigned char *p = (const unsigned char *)buf, *end = p + n, *q;
+
+  if(!enabled)
+    return;
+  while(p < end) {
+    switch(state) {
+    case TEXT:
+      for(q = p; q < end && word_char[*q]; ++q)
+        wordy |= word_char[*q];
+      if(q > p) {
+        if(wordlen + (q - p) <= COMPLETE_MAX)
+          memcpy(word + wordlen, p, q - p);
+        wordlen += q - p;
+        if(q == end)
+          return;                       /* may continue in the next read */
+        p = q;
+      }
+      if(wordlen)
+        end_word();
+      if(*p == 033)
+        state = ESCAPE;
+      break;
+    case ESCAPE:
+      state = *p == '[' ? CSI : *p == ']' ? OSC : TEXT;
+      break;
+    case CSI:
+      if(*p >= 0x40 && *p <= 0x7E)
+        state = TEXT;
+      break;
+    case OSC:
+      if(*p == 7)
+        state = TEXT;
+      else if(*p == 033)
+        state = ESCAPE;
+      break;
+    }
+    ++p;
+  }
+}
+
+/* return the node below which all words start with s, or a null pointer
+ * if there are none */
+static struct node *find(const char *s) {
+  struct node *n = root, *c;
+  size_t i;
+
+  while(*s) {
+    for(c = n->child; c && c->label[0] != *s; c = c->sibling)
+      ;
+    if(!c)
+      return 0;
+    for(i = 1; i < c->len && s[i] && s[i] == c->label[i]; ++i)
+      ;
+    if(i < c->len && s[i])
+      return 0;
+    n = c;
+    s += i;
+  }
+  return n;
+}
+
+static struct node **found;             /* words found by collect() */
+static size_t nfound, nslots;
+
+/* add the words at or below n to found */
+static void collect(struct node *n) {
+  struct node *c;
+
+  if(n->count) {
+    if(nfound == nslots) {
+      nslots = nslots ? 2 * nslots : 64;
+      found = xrealloc(found, nslots * sizeof *found);
+    }
+    found[nfound++] = n;
+  }
+  for(c = n->child; c; c = c->sibling)
+    collect(c);
+}
+
+/* order words by descending count */
+static int compare_count(const void *a, const void *b) {
+  const struct node *x = *(const struct node *const *)a;
+  const struct node *y = *(const struct node *const *)b;
+
+  return x->count > y->count ? -1 : x->count < y->count;
+}
+
+/* return the word ending at n, in memory from xmalloc() */
+static char *word_at(const struct node *n) {
+  const struct node *c;
+  size_t len = 0;
+  char *s, *p;
+
+  for(c = n; c; c = c->parent)
+    len += c->len;
+  p = (s = xmalloc(len + 1)) + len;
+  *p = 0;
+  for(c = n; c; c = c->parent)
+    memcpy(p -= c->len, c->label, c->len);
+  return s;
+}
+
+/* true if s has been seen in the output, and so offered already */
+static int seen(const char *s) {
+  return nwords && *find_word(hash_string(14695981039346656037ULL, s,
+                                          strlen(s)));
+}
+
+/* the length of the prefix that s and t have in common */
+static size_t common(const char *s, const char *t) {
+  size_t n;
+
+  for(n = 0; s[n] && s[n] == t[n]; ++n)
+    ;
+  return n;
+}
+
+/* Readline's attempted completion function.  Every word starting with text
+ * counts towards the prefix that's inserted, but only the first
+ * COMPLETE_LIST are listed, so that a short prefix doesn't copy the whole
+ * dictionary. */
+static char **attempt(const char *text,
+                      int attribute((unused)) start,
+                      int attribute((unused)) end) {
+  struct node *n = 0;
+  size_t first, ndict, word, count = 1, len;
+  char **matches, *prefix = 0;
+  const char *s;
+
+  nfound = 0;
+  if(root && (n = find(text)))
+    collect(n);
+  ndict = words_find(text, &first);
+  if(!nfound && !ndict) {
+    rl_sort_completion_matches = 1;
+    return 0;                           /* complete filenames instead */
+  }
+  /* keep the order they're offered in */
+  rl_sort_completion_matches = 0;
+  if(nfound) {
+    /* all the output's words share n's path and any single line below */
+    while(!n->count && n->child && !n->child->sibling)
+      n = n->child;
+    prefix = word_at(n);
+  }
+  if(ndict) {
+    /* the dictionary is sorted, so its first and last words bound it */
+    s = words_at(first);
+    len = common(s, words_at(first + ndict - 1));
+    if(prefix)
+      len = common(s, prefix) < len ? common(s, prefix) : len;
+    free(prefix);
+    prefix = xmalloc(len + 1);
+    memcpy(prefix, s, len);
+    prefix[len] = 0;
+  }
+  matches = xmalloc((COMPLETE_LIST + 2) * sizeof *matches);
+  matches[0] = prefix;
+  qsort(found, nfound, sizeof *found, compare_count);
+  for(word = 0; word < nfound && count <= COMPLETE_LIST; ++word)
+    matches[count++] = word_at(found[word]);
+  for(word = 0; word < ndict && count <= COMPLETE_LIST; ++word)
+    if(!seen(s = words_at(first + word)))
+      matches[count++] = xstrdup(s);
+  matches[count] = 0;
+  if(count == 2 && !strcmp(matches[0], matches[1])) {
+    /* a single match */
+    free(matches[1]);
+    matches[1] = 0;
+  }
+  return matches;
+}
+
+/* Complete words from the application's dictionary, and from the command's
+ * output if complete_start() has been called. */
+void complete_bind(void) {
+  rl_attempted_completion_function = attempt;
+}
+
+/* Start completing words from the command's output. */
+void complete_start(void) {
+  int c;
+
+  enabled = 1;
+  root = xmalloc(sizeof *root);
+  memset(root, 0, sizeof *root);
+  grow_edges();
+  for(c = 0; c < 256; ++c)
+    if(c >= 0x80 || isalpha(c))
+      word_char[c] = 2;
+    else if(isdigit(c) || (c && strchr("_./-", c)))
+      word_char[c] = 1;
+  complete_bind();
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,153 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Per-prompt history.
+ *
+ * Each prompt signature (see sigs.c) gets a history of its own, in a file
+ * named after a hash of the signature.  A history is loaded the first time
+ * its prompt is seen.  Readline's history list and our indexes of it are
+ * set aside while another prompt is in use, and only CONTEXTS_MAX of them
+ * are kept; the least recently used is dropped to make room, and loaded
+ * again from its file if its prompt comes back.  Nothing is lost by that
+ * as long as lines are written to the file as they're entered, so this
+ * can't be combined with a --history-sync policy other than "every" or with
+ * --history-spool.
+ */
+
+#define CONTEXTS_MAX 4                  /* histories kept in memory */
+
+struct context {
+  char *sig;                            /* prompt signature */
+  char *path;                           /* history file */
+  unsigned long used;                   /* when last used */
+  HISTORY_STATE *history;               /* set-aside state, if not current */
+  struct hist_state *hist;
+  struct search_state *search;
+  struct suggest_state *suggest;
+};
+
+static struct context contexts[CONTEXTS_MAX];
+static int ncontexts, current = -1;
+static unsigned long clock_;            /* counts switches */
+static const char *base;                /* main history file */
+static long max;                        /* entries per history */
+
+/* Use a history per prompt, named after histfile, each keeping up to
+ * maxhistory entries. */
+void ctx_start(const char *histfile, long maxhistory) {
+  base = histfile;
+  max = maxhistory;
+}
+
+/* set aside the current history */
+static void park(struct context *c) {
+  HISTORY_STATE empty;
+
+  c->history = history_get_history_state();
+  memset(&empty, 0, sizeof empty);
+  history_set_history_state(&empty);
+  c->hist = hist_save();
+  c->search = search_save();
+  c->suggest = suggest_save();
+}
+
+/* make c's history current again */
+static void unpark(struct context *c) {
+  history_set_history_state(c->history);
+  free(c->history);
+  c->history = 0;
+  hist_restore(c->hist);
+  search_restore(c->search);
+  suggest_restore(c->suggest);
+}
+
+/* forget a set-aside history */
+static void discard(struct context *c) {
+  int n;
+
+  for(n = 0; n < c->history->length; ++n)
+    free_history_entry(c->history->entries[n]);
+  free(c->history->entries);
+  free(c->history);
+  hist_discard(c->hist);
+  search_discard(c->search);
+  suggest_discard(c->suggest);
+  free(c->sig);
+  free(c->path);
+}
+
+/* load the history for c into the (empty) current history */
+static void load(struct context *c) {
+  long entries = history_load(c->path, max);
+
+  hist_index();
+  hist_limit(max);
+  suggest_index();
+  if(entries > max + HISTORY_SLACK(max))
+    compact_start(c->path, max, hist_control & HC_ERASEDUPS);
+}
+
+/* Switch to the history for prompt signature sig.  Returns the path of its
+ * history file. */
+const char *ctx_switch(const char *sig) {
+  struct context *c;
+  int n, lru;
+
+  for(n = 0; n < ncontexts && strcmp(contexts[n].sig, sig); ++n)
+    ;
+  if(n != current) {
+    if(current >= 0)
+      park(&contexts[current]);
+    if(n < ncontexts)
+      unpark(&contexts[n]);
+    else {
+      if(ncontexts == CONTEXTS_MAX) {
+        /* make room by dropping the least recently used */
+        for(lru = 0, n = 1; n < ncontexts; ++n)
+          if(contexts[n].used < contexts[lru].used)
+            lru = n;
+        discard(&contexts[lru]);
+        n = lru;
+      } else
+        n = ncontexts++;
+      c = &contexts[n];
+      c->sig = xstrdup(sig);
+      c->path = xmalloc(strlen(base) + 32);
+      sprintf(c->path, "%s-%016llx", base,
+              (unsigned long long)hash_string(14695981039346656037ULL,
+                                              sig, strlen(sig)));
+      load(c);
+    }
+    current = n;
+  }
+  contexts[current].used = ++clock_;
+  return contexts[current].path;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
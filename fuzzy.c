@@ -0,0 +1,375 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Fuzzy history picker.
+ *
+ * An entry matches if the search string is a subsequence of it, ignoring
+ * case.  Matches are ranked by how tightly they match (consecutive
+ * characters and characters at the start of words count for more), then
+ * by how recently and how often the line was used.
+ *
+ * When the picker opens, the history is reduced to its distinct lines,
+ * newest first, each with a count and a 64-bit mask of the kinds of byte
+ * it contains.  A line can only match if its mask covers the search
+ * string's, which rules out most non-matches without looking at the line.
+ * Adding a character to the search string can only rule matches out, so
+ * only the previous keystroke's matches are scored again.
+ */
+
+#define FUZZY_SHOW 10                   /* most matches listed */
+
+/* the lines matching a prefix of the search string */
+struct level {
+  uint32_t *cands;                      /* indexes into lines[] */
+  size_t n, slots;
+};
+
+static const char **lines;              /* distinct lines, newest first */
+static uint64_t *masks;                 /* bytes they contain */
+static unsigned *counts;                /* how often they appear */
+static size_t nlines, lslots;
+
+static char *typed, *folded;            /* search string, and lower-cased */
+static size_t qlen, qslots;
+static uint64_t qmask;
+static struct level *levels;            /* levels[n] is for typed[0..n) */
+
+static uint32_t best[FUZZY_SHOW];       /* best matches, best first */
+static int best_score[FUZZY_SHOW];
+static size_t nbest;
+
+static int fold(int c) {
+  return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+/* the mask bit for byte c */
+static uint64_t mask_bit(int c) {
+  c = fold(c);
+  if(c >= 'a' && c <= 'z')
+    return (uint64_t)1 << (c - 'a');
+  if(c >= '0' && c <= '9')
+    return (uint64_t)1 << (26 + c - '0');
+  return (uint64_t)1 << (36 + c % 28);
+}
+
+static uint64_t line_mask(const char *s) {
+  uint64_t m = 0;
+
+  while(*s)
+    m |= mask_bit((unsigned char)*s++);
+  return m;
+}
+
+static int ilog2(unsigned long n) {
+  int b = 0;
+
+  while(n >>= 1)
+    ++b;
+  return b;
+}
+
+/* Score how well line matches the search string, or return -1 if it
+ * doesn't.  If full is 0, just return 0 if it matches. */
+static int score(const char *line, int full) {
+  const char *s, *start, *end;
+  size_t i;
+  int sc = 0, run = 0;
+
+  /* find the first place a match ends... */
+  for(s = line, i = 0; *s && i < qlen; ++s)
+    if(fold((unsigned char)*s) == folded[i])
+      ++i;
+  if(i < qlen)
+    return -1;
+  if(!full)
+    return 0;
+  end = s;
+  /* ...and the latest it can start, for the tightest match ending there */
+  for(i = qlen; i > 0;)
+    if(fold((unsigned char)*--s) == folded[i - 1])
+      --i;
+  start = s;
+  for(s = start, i = 0; s < end; ++s) {
+    if(i < qlen && fold((unsigned char)*s) == folded[i]) {
+      sc += 16;
+      if(run)
+        sc += 8;                        /* follows the previous match */
+      if(s == line || !((s[-1] >= 'a' && s[-1] <= 'z')
+                        || (s[-1] >= 'A' && s[-1] <= 'Z')
+                        || (s[-1] >= '0' && s[-1] <= '9')))
+        sc += 8;                        /* starts a word */
+      run = 1;
+      ++i;
+    } else {
+      --sc;                             /* gap */
+      run = 0;
+    }
+  }
+  return sc;
+}
+
+/* the bonus for line k: up to 20 for being recent, falling off with the
+ * log of its age, and up to 20 for being used often */
+static int bonus(uint32_t k) {
+  int age = 2 * ilog2(k + 1), often = 4 * ilog2(counts[k]);
+
+  return (age < 20 ? 20 - age : 0) + (often < 20 ? often : 20);
+}
+
+/* add line k, with score sc, to the best matches */
+static void consider(uint32_t k, int sc) {
+  size_t i;
+
+  if(nbest < FUZZY_SHOW)
+    ++nbest;
+  /* ties go to the newer line, which was considered first */
+  for(i = nbest - 1; i > 0 && best_score[i - 1] < sc; --i) {
+    best[i] = best[i - 1];
+    best_score[i] = best_score[i - 1];
+  }
+  best[i] = k;
+  best_score[i] = sc;
+}
+
+/* Rank the lines in from.  If to is not a null pointer, the search string
+ * has grown since from was found, and the lines that still match are put
+ * there. */
+static void rank(const struct level *from, struct level *to) {
+  uint32_t k;
+  size_t i;
+  int sc, b, full;
+
+  nbest = 0;
+  if(to) {
+    if(to->slots < from->n) {
+      to->slots = from->n;
+      to->cands = xrealloc(to->cands, to->slots * sizeof *to->cands);
+    }
+    to->n = 0;
+  }
+  for(i = 0; i < from->n; ++i) {
+    k = from->cands[i];
+    if((masks[k] & qmask) != qmask)
+      continue;
+    /* if it can't make the list even with a perfect match, just find out
+     * whether it matches at all */
+    b = bonus(k);
+    full = nbest < FUZZY_SHOW
+      || b + 32 * (int)qlen > best_score[FUZZY_SHOW - 1];
+    if((sc = score(lines[k], full)) < 0)
+      continue;
+    if(to)
+      to->cands[to->n++] = k;
+    if(full && (nbest < FUZZY_SHOW || sc + b > best_score[FUZZY_SHOW - 1]))
+      consider(k, sc + b);
+  }
+}
+
+/* Open the picker with an empty search string. */
+void fuzzy_begin(void) {
+  HIST_ENTRY **list = history_list();
+  uint32_t *table, none = (uint32_t)-1;
+  size_t nslots = 2 * history_length + 1, h, len;
+  const char *line;
+  long pos;
+
+  /* find the distinct lines, newest first */
+  table = xmalloc(nslots * sizeof *table);
+  memset(table, 0xff, nslots * sizeof *table);
+  nlines = 0;
+  for(pos = history_length; pos-- > 0;) {
+    line = list[pos]->line;
+    len = strlen(line);
+    for(h = hash_string(14695981039346656037ULL, line, len) % nslots;
+        table[h] != none && strcmp(lines[table[h]], line);
+        h = (h + 1) % nslots)
+      ;
+    if(table[h] != none) {
+      ++counts[table[h]];
+      continue;
+    }
+    if(nlines == lslots) {
+      lslots = lslots ? 2 * lslots : 1024;
+      lines = xrealloc(lines, lslots * sizeof *lines);
+      masks = xrealloc(masks, lslots * sizeof *masks);
+      counts = xrealloc(counts, lslots * sizeof *counts);
+    }
+    table[h] = nlines;
+    lines[nlines] = line;
+    masks[nlines] = line_mask(line);
+    counts[nlines++] = 1;
+  }
+  free(table);
+  if(!qslots) {
+    qslots = 64;
+    typed = xmalloc(qslots + 1);
+    folded = xmalloc(qslots + 1);
+    levels = xmalloc((qslots + 1) * sizeof *levels);
+    memset(levels, 0, (qslots + 1) * sizeof *levels);
+  }
+  qlen = 0;
+  typed[0] = folded[0] = 0;
+  qmask = 0;
+  if(levels[0].slots < nlines) {
+    levels[0].slots = nlines;
+    levels[0].cands = xrealloc(levels[0].cands,
+                               nlines * sizeof *levels[0].cands);
+  }
+  for(levels[0].n = 0; levels[0].n < nlines; ++levels[0].n)
+    levels[0].cands[levels[0].n] = levels[0].n;
+  rank(&levels[0], 0);
+}
+
+/* Add c to the search string.  Returns the number of matches. */
+size_t fuzzy_narrow(int c) {
+  if(qlen == qslots) {
+    qslots *= 2;
+    typed = xrealloc(typed, qslots + 1);
+    folded = xrealloc(folded, qslots + 1);
+    levels = xrealloc(levels, (qslots + 1) * sizeof *levels);
+    memset(levels + qlen + 1, 0, (qslots - qlen) * sizeof *levels);
+  }
+  typed[qlen] = c;
+  folded[qlen++] = fold(c);
+  typed[qlen] = folded[qlen] = 0;
+  qmask |= mask_bit(c);
+  rank(&levels[qlen - 1], &levels[qlen]);
+  return levels[qlen].n;
+}
+
+/* Remove the last character from the search string.  Returns the number
+ * of matches. */
+size_t fuzzy_widen(void) {
+  size_t i;
+
+  if(qlen) {
+    --qlen;
+    typed[qlen] = folded[qlen] = 0;
+    for(qmask = 0, i = 0; i < qlen; ++i)
+      qmask |= mask_bit((unsigned char)typed[i]);
+    rank(&levels[qlen], 0);
+  }
+  return levels[qlen].n;
+}
+
+/* Return the nth best match, or a null pointer if there are fewer than
+ * n+1. */
+const char *fuzzy_result(size_t n) {
+  return n < nbest ? lines[best[n]] : 0;
+}
+
+/* List the best matches under the edit line, highlighting the selected
+ * one, and put the cursor back where it was. */
+static void list(size_t sel) {
+  FILE *fp = rl_outstream;
+  int rows, cols, w;
+  size_t n, i;
+  const char *s;
+
+  rl_get_screen_size(&rows, &cols);
+  n = rows > 2 && (size_t)rows - 2 < nbest ? (size_t)rows - 2 : nbest;
+  /* make room first, so the terminal doesn't scroll under a saved cursor
+   * position */
+  for(i = 0; i < (n ? n : 1); ++i)
+    fputs("\033D", fp);
+  fprintf(fp, "\033[%zuA\0337\r\n\033[J", n ? n : 1);
+  for(i = 0; i < n; ++i) {
+    if(i)
+      fputs("\r\n", fp);
+    if(i == sel)
+      fputs("\033[7m", fp);
+    for(s = lines[best[i]], w = 0; *s && (w < cols - 1
+                                          || (*s & 0xC0) == 0x80); ++s) {
+      if((*s & 0xC0) != 0x80)
+        ++w;
+      fputc((unsigned char)*s < ' ' || *s == 127 ? '?' : *s, fp);
+    }
+    if(i == sel)
+      fputs("\033[m", fp);
+  }
+  fputs("\0338", fp);
+  fflush(fp);
+}
+
+/* the picker itself */
+static int picker(int attribute((unused)) count,
+                  int attribute((unused)) key) {
+  char *original = rl_copy_text(0, rl_end);
+  int point = rl_point, c;
+  size_t sel = 0;
+
+  fuzzy_begin();
+  rl_save_prompt();
+  for(;;) {
+    rl_replace_line(nbest ? lines[best[sel]] : original, 0);
+    rl_point = rl_end;
+    rl_message("(fuzzy)`%s': ", typed);
+    list(sel);
+    c = rl_read_key();
+    if(c == ESC) {
+      /* cursor keys move the selection; anything else cancels */
+      if((c = rl_read_key()) == '[' || c == 'O')
+        c = rl_read_key();
+      c = c == 'A' ? CTRL('P') : c == 'B' ? CTRL('N') : CTRL('G');
+    }
+    if(c == CTRL('P')) {
+      if(sel) --sel; else rl_ding();
+    } else if(c == CTRL('N')) {
+      if(sel + 1 < nbest) ++sel; else rl_ding();
+    } else if(c == RUBOUT || c == CTRL('H')) {
+      if(qlen) fuzzy_widen(); else rl_ding();
+      sel = 0;
+    } else if(c == CTRL('G') || c == EOF) {
+      rl_replace_line(original, 0);
+      rl_point = point;
+      break;
+    } else if(c == '\r' || c == '\n' || c == '\t') {
+      /* the selection is already in the line, ready to edit */
+      break;
+    } else if(c >= ' ') {
+      if(!fuzzy_narrow(c)) rl_ding();
+      sel = 0;
+    } else
+      rl_ding();
+  }
+  nbest = 0;
+  list(0);                              /* clear the list */
+  free(original);
+  rl_restore_prompt();
+  rl_clear_message();
+  return 0;
+}
+
+/* Bind the picker to C-x r, unless the user's inputrc says otherwise. */
+void fuzzy_bind(void) {
+  rl_add_defun("fuzzy-history-search", picker, -1);
+  rl_bind_keyseq("\\C-xr", picker);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,405 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* History control.
+ *
+ * Every entry in Readline's history list gets a serial number, kept in an
+ * array parallel to the list.  (Readline uses the entries' data field for
+ * its own purposes, so it can't go there.)  Serial numbers increase along
+ * the list, so an entry's position can be found from its serial number by
+ * binary search, however many entries have been removed.
+ *
+ * A hash table maps the content of each line to the serial number of its
+ * latest entry, so finding a duplicate doesn't need a scan of the list.
+ * Readline may change an entry's content behind our back (when a recalled
+ * line is edited) so a hit is always checked against the entry itself.
+ *
+ * The history size is limited here rather than with stifle_history().  A
+ * stifled list that is full moves every entry down by one each time a line is
+ * added, so a line costs time proportional to the size of the history.
+ * Instead we let the list grow by HISTORY_SLACK() entries beyond the limit
+ * and then remove the oldest entries all at once, making the cost per line
+ * constant on average.  (Readline indexes its history as a plain array, so
+ * there's no way to give it a ring buffer.)  Only taking them out of the
+ * list happens at once; they are forgotten and freed HIST_FREE_STEP at a
+ * time as further lines are added, so that no one line takes long.
+ */
+
+#define HIST_BUCKETS_MIN 1024
+#define HIST_FREE_STEP 64               /* old entries freed per line */
+
+struct node {
+  struct node *next;
+  uint64_t hash;                        /* hash of line */
+  long serial;                          /* latest entry with this line */
+};
+
+int hist_control;                       /* HC_... flags */
+
+static struct node **buckets;
+static size_t nbuckets, nnodes;
+
+static long *serials;                   /* parallel to the history list */
+static size_t sstart, slength, sslots;  /* live part is [sstart,+slength) */
+static long next_serial;
+
+static long limit = -1;                 /* maximum entries, or -1 */
+
+static HIST_ENTRY **dead;               /* removed but not yet freed */
+static long *dead_serials;              /* ...and their serial numbers */
+static size_t ndead, dead_next;         /* [dead_next,ndead) are left */
+static size_t dead_slots;
+
+static uint64_t hash_line(const char *line) {
+  return hash_string(14695981039346656037ULL, line, strlen(line));
+}
+
+/* parse a HISTCONTROL-style colon-separated list */
+void hist_control_parse(const char *s) {
+  static const struct {
+    const char *name;
+    int flags;
+  } words[] = {
+    { "ignoredups", HC_IGNOREDUPS },
+    { "ignorespace", HC_IGNORESPACE },
+    { "ignoreboth", HC_IGNOREDUPS|HC_IGNORESPACE },
+    { "erasedups", HC_ERASEDUPS },
+    { 0, 0 }
+  };
+  const char *e;
+  size_t n;
+  int w;
+
+  hist_control = 0;
+  while(*s) {
+    n = (e = strchr(s, ':')) ? (size_t)(e - s) : strlen(s);
+    /* anything we don't recognize is ignored, as Bash does */
+    for(w = 0; words[w].name; ++w)
+      if(strlen(words[w].name) == n && !strncmp(s, words[w].name, n))
+        hist_control |= words[w].flags;
+    s += n;
+    if(*s) ++s;
+  }
+}
+
+static struct node **find_node(uint64_t hash) {
+  struct node **np;
+
+  for(np = &buckets[hash % nbuckets]; *np && (*np)->hash != hash;
+      np = &(*np)->next)
+    ;
+  return np;
+}
+
+static void grow_table(void) {
+  struct node **old = buckets, *n, *next;
+  size_t oldn = nbuckets, i;
+
+  nbuckets = nbuckets ? 2 * nbuckets : HIST_BUCKETS_MIN;
+  buckets = xmalloc(nbuckets * sizeof *buckets);
+  memset(buckets, 0, nbuckets * sizeof *buckets);
+  for(i = 0; i < oldn; ++i)
+    for(n = old[i]; n; n = next) {
+      next = n->next;
+      n->next = buckets[n->hash % nbuckets];
+      buckets[n->hash % nbuckets] = n;
+    }
+  free(old);
+}
+
+/* record that line's latest entry has serial number serial */
+static void set_node(const char *line, long serial) {
+  uint64_t hash = hash_line(line);
+  struct node **np, *n;
+
+  if(nnodes >= nbuckets)
+    grow_table();
+  if(!*(np = find_node(hash))) {
+    n = xmalloc(sizeof *n);
+    n->hash = hash;
+    n->next = 0;
+    *np = n;
+    ++nnodes;
+  }
+  (*np)->serial = serial;
+}
+
+/* forget line, if its latest entry has serial number serial */
+static void drop_node(const char *line, long serial) {
+  struct node **np, *n;
+
+  if((n = *(np = find_node(hash_line(line)))) && n->serial == serial) {
+    *np = n->next;
+    free(n);
+    --nnodes;
+  }
+}
+
+/* return the number of entries older than serial number serial */
+static long lower(long serial) {
+  size_t lo = 0, hi = slength, mid;
+
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(serials[sstart + mid] < serial)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* return the position of the entry with the given serial number, or -1 */
+long hist_position(long serial) {
+  long pos = lower(serial);
+
+  return (size_t)pos < slength && serials[sstart + pos] == serial ? pos : -1;
+}
+
+/* return the serial number of the entry at position pos */
+long hist_serial(long pos) {
+  return serials[sstart + pos];
+}
+
+/* add a serial number for a new entry at the end of the list */
+static void push_serial(long serial) {
+  if(sstart + slength == sslots) {
+    if(sstart) {
+      memmove(serials, serials + sstart, slength * sizeof *serials);
+      sstart = 0;
+    } else {
+      sslots = sslots ? 2 * sslots : 256;
+      serials = xrealloc(serials, sslots * sizeof *serials);
+    }
+  }
+  serials[sstart + slength++] = serial;
+}
+
+/* forget and free up to n removed entries */
+static void free_dead(size_t n) {
+  for(; n && dead_next < ndead; --n, ++dead_next) {
+    drop_node(dead[dead_next]->line, dead_serials[dead_next]);
+    free_history_entry(dead[dead_next]);
+  }
+  if(dead_next == ndead)
+    ndead = dead_next = 0;
+}
+
+/* Remove n entries starting at position pos from both lists.  If later is
+ * set then they are left for free_dead(). */
+static void remove_entries(int pos, int n, int later) {
+  HIST_ENTRY **list = history_list(), **removed;
+  HISTORY_STATE *state;
+  int i;
+
+  if(later) {
+    free_dead(ndead);                   /* finish off the last lot */
+    if((size_t)n > dead_slots) {
+      dead_slots = n;
+      dead = xrealloc(dead, dead_slots * sizeof *dead);
+      dead_serials = xrealloc(dead_serials,
+                              dead_slots * sizeof *dead_serials);
+    }
+    memcpy(dead, list + pos, n * sizeof *dead);
+    memcpy(dead_serials, serials + sstart + pos, n * sizeof *dead_serials);
+    ndead = n;
+    /* remove_history_range() would copy them into a new array for us to
+     * free, and freeing that much at once can take a while */
+    state = history_get_history_state();
+    memmove(state->entries + pos, state->entries + pos + n,
+            (state->length - pos - n + 1) * sizeof *state->entries);
+    state->length -= n;
+    if(state->offset > state->length)
+      state->offset = state->length;
+    history_set_history_state(state);
+    free(state);
+  } else {
+    for(i = 0; i < n; ++i)
+      drop_node(list[pos + i]->line, serials[sstart + pos + i]);
+    removed = remove_history_range(pos, pos + n - 1);
+    for(i = 0; removed && removed[i]; ++i)
+      free_history_entry(removed[i]);
+    free(removed);
+  }
+  if(!pos) {
+    sstart += n;                        /* the common case: oldest first */
+    search_forget(slength > (size_t)n ? serials[sstart] : next_serial);
+    suggest_forget(slength > (size_t)n ? serials[sstart] : next_serial);
+  } else
+    memmove(serials + sstart + pos, serials + sstart + pos + n,
+            (slength - pos - n) * sizeof *serials);
+  slength -= n;
+}
+
+/* Limit the history to max entries (plus slack). */
+void hist_limit(long max) {
+  unstifle_history();
+  limit = max;
+  if(history_length > limit)
+    remove_entries(0, history_length - limit, 0);
+  /* grow the table now rather than while a line is being added; the slack
+   * and the entries waiting for free_dead() need room as well */
+  while(limit > 0 && nbuckets <= (size_t)(limit + 2 * HISTORY_SLACK(limit)))
+    grow_table();
+}
+
+/* Index the history as loaded.  With erasedups, only the latest of any set
+ * of identical entries is kept. */
+void hist_index(void) {
+  HISTORY_STATE *state;
+  struct node *n;
+  size_t b;
+  int i, j;
+
+  free_dead(ndead);
+  if(!nbuckets)
+    grow_table();
+  /* an empty history may not even have a list */
+  if((hist_control & HC_ERASEDUPS) && history_length) {
+    /* newest first, so the first entry we see for each line is its latest.
+     * For now the table maps lines to positions. */
+    state = history_get_history_state();
+    for(i = state->length; i-- > 0;) {
+      if((n = *find_node(hash_line(state->entries[i]->line)))
+         && !strcmp(state->entries[n->serial]->line,
+                    state->entries[i]->line)) {
+        free_history_entry(state->entries[i]);
+        state->entries[i] = 0;
+      } else
+        set_node(state->entries[i]->line, i);
+    }
+    for(i = j = 0; i < state->length; ++i)
+      if(state->entries[i])
+        state->entries[j++] = state->entries[i];
+    state->entries[j] = 0;
+    state->length = state->offset = j;
+    history_set_history_state(state);
+    free(state);
+    for(b = 0; b < nbuckets; ++b)
+      while((n = buckets[b])) {
+        buckets[b] = n->next;
+        free(n);
+      }
+    nnodes = 0;
+  }
+  for(i = 0; i < history_length; ++i) {
+    push_serial(next_serial);
+    set_node(history_list()[i]->line, next_serial++);
+  }
+}
+
+/* the index of one history list, while another is in use */
+struct hist_state {
+  struct node **buckets;
+  size_t nbuckets, nnodes;
+  long *serials;
+  size_t sstart, slength, sslots;
+};
+
+/* Set aside the index of the current history list, and start an empty
+ * one. */
+struct hist_state *hist_save(void) {
+  struct hist_state *hs = xmalloc(sizeof *hs);
+
+  free_dead(ndead);                     /* they belong to this index */
+  hs->buckets = buckets;
+  hs->nbuckets = nbuckets;
+  hs->nnodes = nnodes;
+  hs->serials = serials;
+  hs->sstart = sstart;
+  hs->slength = slength;
+  hs->sslots = sslots;
+  buckets = 0;
+  nbuckets = nnodes = 0;
+  serials = 0;
+  sstart = slength = sslots = 0;
+  return hs;
+}
+
+/* Go back to an index set aside by hist_save(), discarding the current
+ * one. */
+void hist_restore(struct hist_state *hs) {
+  hist_discard(hist_save());
+  buckets = hs->buckets;
+  nbuckets = hs->nbuckets;
+  nnodes = hs->nnodes;
+  serials = hs->serials;
+  sstart = hs->sstart;
+  slength = hs->slength;
+  sslots = hs->sslots;
+  free(hs);
+}
+
+/* Free an index set aside by hist_save(). */
+void hist_discard(struct hist_state *hs) {
+  struct node *n;
+  size_t b;
+
+  for(b = 0; b < hs->nbuckets; ++b)
+    while((n = hs->buckets[b])) {
+      hs->buckets[b] = n->next;
+      free(n);
+    }
+  free(hs->buckets);
+  free(hs->serials);
+  free(hs);
+}
+
+/* Add line to the history, subject to hist_control.  Returns 1 if it was
+ * added, or 0 if it was ignored. */
+int hist_add(const char *line) {
+  HIST_ENTRY **list = history_list();
+  struct node *n;
+  long pos;
+
+  if((hist_control & HC_IGNORESPACE) && *line == ' ')
+    return 0;
+  if((hist_control & HC_IGNOREDUPS) && history_length
+     && !strcmp(list[history_length - 1]->line, line))
+    return 0;
+  if((hist_control & HC_ERASEDUPS)
+     && (n = *find_node(hash_line(line)))
+     && (pos = hist_position(n->serial)) >= 0
+     && !strcmp(list[pos]->line, line))
+    remove_entries(pos, 1, 0);
+  if(!limit)
+    return 1;                           /* not keeping anything */
+  add_history(line);
+  push_serial(next_serial);
+  search_add(line, next_serial);
+  suggest_add(line, next_serial);
+  set_node(line, next_serial++);
+  if(limit > 0 && history_length > limit + HISTORY_SLACK(limit))
+    remove_entries(0, history_length - limit, 1);
+  else if(ndead)
+    free_dead(HIST_FREE_STEP);
+  return 1;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
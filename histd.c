@@ -0,0 +1,390 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Shared history daemon.
+ *
+ * One daemon per user keeps every history file that its clients have asked
+ * for in memory, already split into records.  The protocol is line-based:
+ *
+ *   L MAX PATH       client wants (at most MAX records of) PATH.  The daemon
+ *                    replies with the records, one line each (preceded by a
+ *                    timestamp line if they have one), then an empty line.
+ *   T TIMESTAMP      the next A's line has this timestamp line.
+ *   A LINE           append LINE to the history file named by the last L.
+ *
+ * The daemon notices if the file has been changed behind its back (e.g. by
+ * a session not using the daemon) and reloads it.
+ */
+
+#define HISTD_IDLE 600                  /* lifetime without clients */
+
+struct histstore {
+  struct histstore *next;
+  char *path;                           /* history file */
+  char **records;                       /* "[#TIME\n]LINE" */
+  size_t nrecords, nslots;
+  long max;                             /* largest MAX anyone asked for */
+  struct stat sb;                       /* file as of last load/append */
+};
+
+struct client {
+  struct client *next;
+  int fd;
+  struct buffer in;                     /* partial request */
+  struct buffer out;                    /* reply not yet sent */
+  struct histstore *store;              /* set by L */
+  char *ts;                             /* set by T */
+};
+
+static int histd_conn = -1;             /* connection to daemon */
+
+static char *histd_path(void) {
+  char *path;
+
+  path = xmalloc(strlen(rundir()) + 16);
+  sprintf(path, "%s/histd", rundir());
+  return path;
+}
+
+/* true if s is a timestamp line */
+static int is_timestamp(const char *s) {
+  return s[0] == '#' && s[1] >= '0' && s[1] <= '9';
+}
+
+static void store_add(struct histstore *h, char *record) {
+  size_t drop;
+
+  if(h->nrecords == h->nslots) {
+    h->nslots = h->nslots ? 2 * h->nslots : 256;
+    h->records = xrealloc(h->records, h->nslots * sizeof *h->records);
+  }
+  h->records[h->nrecords++] = record;
+  /* trim in batches so that appending stays cheap */
+  if(h->max > 0 && h->nrecords > (size_t)(h->max + HISTORY_SLACK(h->max))) {
+    drop = h->nrecords - h->max;
+    while(drop--)
+      free(h->records[drop]);
+    drop = h->nrecords - h->max;
+    memmove(h->records, h->records + drop, h->max * sizeof *h->records);
+    h->nrecords = h->max;
+  }
+}
+
+/* (re-)read h->path, trimming the file if it has got too big */
+static void store_load(struct histstore *h) {
+  FILE *fp;
+  char *l = 0, *ts = 0, *r;
+  size_t n = 0, total = 0;
+  ssize_t len;
+
+  while(h->nrecords)
+    free(h->records[--h->nrecords]);
+  memset(&h->sb, 0, sizeof h->sb);
+  if(!(fp = fopen(h->path, "r")))
+    return;
+  fstat(fileno(fp), &h->sb);
+  while((len = getline(&l, &n, fp)) >= 0) {
+    if(len && l[len - 1] == '\n') l[--len] = 0;
+    if(is_timestamp(l)) {
+      free(ts);
+      ts = xstrdup(l);
+    } else if(*l) {
+      if(ts) {
+        r = xmalloc(strlen(ts) + len + 2);
+        sprintf(r, "%s\n%s", ts, l);
+        free(ts);
+        ts = 0;
+      } else
+        r = xstrdup(l);
+      store_add(h, r);
+      ++total;
+    }
+  }
+  free(ts);
+  free(l);
+  fclose(fp);
+  /* clients leave this to us.  The file will be replaced, which will make
+   * it look stale; that's harmless. */
+  if(h->max > 0 && total > (size_t)(h->max + HISTORY_SLACK(h->max)))
+    compact_start(h->path, h->max, 0);
+}
+
+/* true if h->path has changed since we last looked at it */
+static int store_stale(struct histstore *h) {
+  struct stat sb;
+
+  if(stat(h->path, &sb) < 0)
+    return h->sb.st_ino != 0;
+  return sb.st_ino != h->sb.st_ino
+    || sb.st_size != h->sb.st_size
+    || sb.st_mtime != h->sb.st_mtime;
+}
+
+static struct histstore *store_find(struct histstore **stores,
+                                    const char *path, long max) {
+  struct histstore *h;
+
+  for(h = *stores; h && strcmp(h->path, path); h = h->next)
+    ;
+  if(!h) {
+    h = xmalloc(sizeof *h);
+    memset(h, 0, sizeof *h);
+    h->path = xstrdup(path);
+    h->next = *stores;
+    *stores = h;
+    h->max = max;
+    store_load(h);
+  } else {
+    if(max > h->max) h->max = max;
+    if(store_stale(h))
+      store_load(h);
+  }
+  return h;
+}
+
+/* handle one request line.  Returns 0 to keep the client, else an errno
+ * value. */
+static int request(struct histstore **stores, struct client *c, char *req) {
+  struct histstore *h;
+  char *path, *record;
+  size_t n;
+  long max;
+  int fd;
+
+  switch(req[0]) {
+  case 'L':
+    max = strtol(req + 1, &path, 10);
+    if(*path++ != ' ' || *path != '/') return EINVAL;
+    h = c->store = store_find(stores, path, max);
+    /* the reply is sent as the client reads it, so that a client that
+     * stops reading can't hold up everyone else */
+    n = h->nrecords > (size_t)max && max > 0 ? h->nrecords - max : 0;
+    for(; n < h->nrecords; ++n) {
+      buffer_append(&c->out, h->records[n], strlen(h->records[n]));
+      buffer_append(&c->out, "\n", 1);
+    }
+    buffer_append(&c->out, "\n", 1);
+    return 0;
+  case 'T':
+    if(req[1] != ' ' || !is_timestamp(req + 2)) return EINVAL;
+    free(c->ts);
+    c->ts = xstrdup(req + 2);
+    return 0;
+  case 'A':
+    if(!(h = c->store) || req[1] != ' ' || !req[2]) return EINVAL;
+    if(store_stale(h))
+      store_load(h);
+    if(c->ts) {
+      record = xmalloc(strlen(c->ts) + strlen(req + 2) + 2);
+      sprintf(record, "%s\n%s", c->ts, req + 2);
+      free(c->ts);
+      c->ts = 0;
+    } else
+      record = xstrdup(req + 2);
+    store_add(h, record);
+    if((fd = history_open_append(h->path)) >= 0) {
+      do_writen(fd, record, strlen(record));
+      do_writen(fd, "\n", 1);
+      fstat(fd, &h->sb);
+      close(fd);
+    }
+    return 0;
+  default:
+    return EINVAL;
+  }
+}
+
+/* the daemon's main loop */
+static void daemon_loop(int listenfd) {
+  struct histstore *stores = 0;
+  struct client *clients = 0, *c, **cc;
+  struct timeval tv;
+  fd_set fds, wfds;
+  int max, n, fd;
+  char buf[4096], *nl;
+  size_t m;
+
+  for(;;) {
+    FD_ZERO(&fds);
+    FD_ZERO(&wfds);
+    FD_SET(listenfd, &fds);
+    max = listenfd;
+    for(c = clients; c; c = c->next) {
+      FD_SET(c->fd, &fds);
+      if(c->out.start != c->out.end)
+        FD_SET(c->fd, &wfds);
+      if(c->fd > max) max = c->fd;
+    }
+    tv.tv_sec = HISTD_IDLE;
+    tv.tv_usec = 0;
+    n = select(max + 1, &fds, &wfds, 0, clients ? 0 : &tv);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      fatal(errno, "error calling select");
+    }
+    if(n == 0) return;                  /* idle for too long */
+    if(FD_ISSET(listenfd, &fds) && (fd = accept(listenfd, 0, 0)) >= 0) {
+      c = xmalloc(sizeof *c);
+      memset(c, 0, sizeof *c);
+      c->fd = fd;
+      nonblock(fd);
+      buffer_init(&c->in);
+      buffer_init(&c->out);
+      c->next = clients;
+      clients = c;
+    }
+    for(cc = &clients; (c = *cc);) {
+      n = 0;
+      if(FD_ISSET(c->fd, &fds)) {
+        n = read(c->fd, buf, sizeof buf);
+        if(n > 0) {
+          buffer_append(&c->in, buf, n);
+          n = 0;
+          while(!n && (nl = memchr(c->in.start, '\n',
+                                   c->in.end - c->in.start))) {
+            *nl = 0;
+            n = request(&stores, c, c->in.start);
+            c->in.start = nl + 1;
+          }
+          /* move any partial request down, so the buffer only grows for
+           * long requests */
+          m = c->in.end - c->in.start;
+          memmove(c->in.base, c->in.start, m);
+          c->in.start = c->in.base;
+          c->in.end = c->in.base + m;
+        } else if(n < 0 && (errno == EINTR || errno == EAGAIN))
+          n = 0;
+        else
+          n = 1;                        /* EOF or error */
+      }
+      if(!n && FD_ISSET(c->fd, &wfds)
+         && (n = buffer_write(&c->out, c->fd)) == EAGAIN)
+        n = 0;
+      if(n) {
+        close(c->fd);
+        free(c->in.base);
+        free(c->out.base);
+        free(c->ts);
+        *cc = c->next;
+        free(c);
+      } else
+        cc = &c->next;
+    }
+  }
+}
+
+/* Load up to max entries of histfile via the daemon, starting it if
+ * necessary.  Returns 1 on success or 0 if the caller should read the file
+ * itself. */
+int histd_load(const char *histfile, long max) {
+  char *path, *req, *l = 0, *ts = 0;
+  int fd, tries, listenfd, done = 0;
+  size_t n = 0;
+  ssize_t len;
+  FILE *fp;
+
+  path = histd_path();
+  if((fd = unix_connect(path)) < 0) {
+    if(!daemonize()) {
+      if((listenfd = unix_listen(path)) < 0)
+        _exit(0);                       /* someone else beat us to it */
+      daemon_loop(listenfd);
+      unlink(path);
+      _exit(0);
+    }
+    for(tries = 0; tries < 100 && (fd = unix_connect(path)) < 0; ++tries)
+      usleep(10000);
+  }
+  free(path);
+  if(fd < 0)
+    return 0;
+  cloexec(fd);
+  req = xmalloc(strlen(histfile) + 64);
+  sprintf(req, "L %ld %s\n", max, histfile);
+  if(send_all(fd, req, strlen(req))) {
+    free(req);
+    close(fd);
+    return 0;
+  }
+  free(req);
+  if(!(fp = fdopen(dup(fd), "r")))
+    fatal(errno, "error calling fdopen");
+  while(!done && (len = getline(&l, &n, fp)) > 0 && l[len - 1] == '\n') {
+    l[--len] = 0;
+    if(!len)
+      done = 1;                         /* end of the reply */
+    else if(is_timestamp(l)) {
+      free(ts);
+      ts = xstrdup(l);
+    } else {
+      add_history(l);
+      if(ts) {
+        add_history_time(ts);
+        free(ts);
+        ts = 0;
+      }
+    }
+  }
+  free(ts);
+  free(l);
+  fclose(fp);
+  if(!done) {
+    /* the daemon went away part way through; start from scratch */
+    clear_history();
+    close(fd);
+    return 0;
+  }
+  histd_conn = fd;
+  return 1;
+}
+
+/* Append a line, with timestamp line ts if that's not a null pointer, to
+ * the history file via the daemon.  Returns 0 on success or an errno value,
+ * in which case the caller should do it itself. */
+int histd_append(const char *ts, const char *line) {
+  char *req;
+  int err;
+
+  if(histd_conn == -1)
+    return ENOTCONN;
+  req = xmalloc((ts ? strlen(ts) : 0) + strlen(line) + 8);
+  if(ts)
+    sprintf(req, "T %s\nA %s\n", ts, line);
+  else
+    sprintf(req, "A %s\n", line);
+  /* a dead daemon is an error, not a fatal SIGPIPE */
+  if((err = send_all(histd_conn, req, strlen(req)))) {
+    close(histd_conn);
+    histd_conn = -1;
+  }
+  free(req);
+  return err;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,248 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#include <sys/mman.h>
+
+/* History loading.
+ *
+ * read_history() reads and parses the whole file and creates an entry for
+ * every line in it, only for stifle_history() to throw most of them away
+ * again.  Instead we map the file and walk backwards from the end, so that
+ * only the entries that will be kept are ever copied out of it.
+ *
+ * Readline owns its history entries and frees them individually, so they
+ * can't point into the mapping or be allocated from an arena of ours.
+ *
+ * A compressed history (see histz.c) can't be walked backwards, so it is
+ * decoded from the start instead, keeping only the last max records as it
+ * goes.
+ */
+
+struct entry {
+  const char *line, *ts;                /* record and its timestamp */
+  size_t len, tslen;
+};
+
+/* add s[0..n) to the history */
+static size_t add(const char *s, size_t n, int ts, struct buffer *b) {
+  buffer_clear(b);
+  buffer_append(b, s, n);
+  buffer_append(b, "", 1);
+  if(ts)
+    add_history_time(b->start);
+  else
+    add_history(b->start);
+  return n + 1;
+}
+
+/* the last records of a history being decoded */
+struct ring {
+  char **lines, **stamps;               /* circular; stamps may be null */
+  long max, count;                      /* count is records seen */
+  char *ts;                             /* timestamp for the next record */
+  struct buffer partial;                /* incomplete line */
+};
+
+/* add one line of decoded history to r */
+static void ring_line(struct ring *r, const char *s, size_t n) {
+  char *l = xmalloc(n + 1);
+  long slot;
+
+  memcpy(l, s, n);
+  l[n] = 0;
+  if(n > 1 && s[0] == '#' && s[1] >= '0' && s[1] <= '9') {
+    free(r->ts);
+    r->ts = l;
+  } else if(n) {
+    if(r->max) {
+      slot = r->count % r->max;
+      free(r->lines[slot]);
+      free(r->stamps[slot]);
+      r->lines[slot] = l;
+      r->stamps[slot] = r->ts;
+    } else {
+      free(l);
+      free(r->ts);
+    }
+    r->ts = 0;
+    ++r->count;
+  } else
+    free(l);
+}
+
+/* history_decode() callback */
+static void ring_text(void *u, const char *s, size_t n) {
+  struct ring *r = u;
+  const char *l, *nl;
+
+  if(!s)
+    return;
+  buffer_append(&r->partial, s, n);
+  for(l = r->partial.start;
+      (nl = memchr(l, '\n', r->partial.end - l));
+      l = nl + 1)
+    ring_line(r, l, nl - l);
+  /* move the incomplete line down, so the buffer only grows for long
+   * lines */
+  n = r->partial.end - l;
+  memmove(r->partial.base, l, n);
+  r->partial.start = r->partial.base;
+  r->partial.end = r->partial.base + n;
+}
+
+/* load the last max entries of the n bytes at base, which need decoding,
+ * into the history.  Returns the number of entries. */
+static long history_decode_map(const char *base, size_t n, long max,
+                               size_t *copied) {
+  struct ring r;
+  long k, slot;
+
+  memset(&r, 0, sizeof r);
+  r.max = max;
+  r.lines = xmalloc((max ? max : 1) * sizeof *r.lines);
+  r.stamps = xmalloc((max ? max : 1) * sizeof *r.stamps);
+  memset(r.lines, 0, (max ? max : 1) * sizeof *r.lines);
+  memset(r.stamps, 0, (max ? max : 1) * sizeof *r.stamps);
+  buffer_init(&r.partial);
+  history_decode(base, n, ring_text, &r);
+  /* copy them into the history, oldest first */
+  for(k = r.count < max ? 0 : r.count - max; k < r.count; ++k) {
+    slot = k % max;
+    add_history(r.lines[slot]);
+    *copied += strlen(r.lines[slot]) + 1;
+    if(r.stamps[slot])
+      add_history_time(r.stamps[slot]);
+    free(r.lines[slot]);
+    free(r.stamps[slot]);
+  }
+  free(r.lines);
+  free(r.stamps);
+  free(r.ts);
+  free(r.partial.base);
+  return r.count;
+}
+
+/* Load the last max entries of path into the history.  *entriesp is set to
+ * the number of entries in the file, or limit if there are more than that.
+ * Returns 0 on success or an errno value. */
+int history_map(const char *path, long max, long limit, long *entriesp) {
+  struct stat sb;
+  struct entry *entries, *last = 0;
+  struct buffer b;
+  const char *base, *start, *end, *nl;
+  size_t copied = 0;
+  long count = 0, n;
+  int fd, err;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return errno;
+  if(fstat(fd, &sb) < 0) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+  *entriesp = 0;
+  if(!sb.st_size) {
+    close(fd);
+    return 0;
+  }
+  base = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  err = errno;
+  close(fd);
+  if(base == MAP_FAILED)
+    return err;
+  if(!history_plain(base, sb.st_size)) {
+    count = history_decode_map(base, sb.st_size, max, &copied);
+    munmap((void *)base, sb.st_size);
+    timing_count("history bytes mapped", sb.st_size);
+    timing_count("history bytes copied", copied);
+    *entriesp = count < limit ? count : limit;
+    return 0;
+  }
+  entries = xmalloc((max ? max : 1) * sizeof *entries);
+  end = base + sb.st_size;
+  if(end[-1] == '\n') --end;
+  /* find the records we want, newest first */
+  while(end > base && count < limit) {
+    nl = memrchr(base, '\n', end - base);
+    start = nl ? nl + 1 : base;
+    if(end - start > 1 && start[0] == '#'
+       && start[1] >= '0' && start[1] <= '9') {
+      /* a timestamp belongs to the record after it */
+      if(last && !last->ts) {
+        last->ts = start;
+        last->tslen = end - start;
+      }
+      last = 0;
+    } else if(start < end) {
+      if(count < max) {
+        last = &entries[count];
+        last->line = start;
+        last->len = end - start;
+        last->ts = 0;
+      } else
+        last = 0;
+      ++count;
+    }
+    end = nl ? nl : base;
+  }
+  /* copy them into the history, oldest first */
+  buffer_init(&b);
+  for(n = count < max ? count : max; n-- > 0;) {
+    copied += add(entries[n].line, entries[n].len, 0, &b);
+    if(entries[n].ts)
+      copied += add(entries[n].ts, entries[n].tslen, 1, &b);
+  }
+  free(b.base);
+  free(entries);
+  munmap((void *)base, sb.st_size);
+  timing_count("history bytes mapped", sb.st_size);
+  timing_count("history bytes copied", copied);
+  *entriesp = count;
+  return 0;
+}
+
+/* Load the history in path, keeping the last max entries, and creating the
+ * file if it doesn't exist.  Returns the number of entries in the file, as
+ * history_map() does. */
+long history_load(const char *path, long max) {
+  long entries = 0;
+  int err, fd;
+
+  if((err = history_map(path, max, max + HISTORY_SLACK(max) + 1, &entries))
+     == ENOENT) {
+    /* append_history() only works if the file exists */
+    if((fd = open(path, O_WRONLY|O_CREAT, 0600)) < 0)
+      fatal(errno, "error creating %s", path);
+    xclose(fd);
+  } else if(err)
+    fatal(err, "error reading %s", path);
+  return entries;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
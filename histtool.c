@@ -0,0 +1,499 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#include <sys/mman.h>
+#include <regex.h>
+
+/* Offline history maintenance.
+ *
+ * history_tool() merges history files, optionally dropping lines that don't
+ * match a regexp, all but the latest of identical lines, and all but the
+ * newest max records, and writes the result in the usual format.
+ *
+ * Inputs are mapped rather than read, and merged by timestamp as in the
+ * merge phase of an external sort; each is assumed to be in order already,
+ * as history files are.  A record without a timestamp sorts with the one
+ * before it.
+ *
+ * Keeping the latest of identical lines, or the newest records, means
+ * knowing what comes later, so there are two passes.  The first splits the
+ * inputs into parts of at least TOOL_PART bytes and scans them in
+ * parallel, in up to one process per CPU, each reporting the last
+ * appearance of every distinct line in its part.  The second merges the
+ * inputs and writes out the records that survive.
+ * Identical lines are spotted by their 64-bit hash alone, unlike hist.c,
+ * which checks the text; comparing text would mean going back to records
+ * anywhere in the inputs.  So two different lines with the same hash count
+ * as one, which is unlikely below billions of distinct lines.  Compressed
+ * inputs are decoded to temporary files first.  Memory use is
+ * proportional to the number of inputs, plus the number of distinct lines
+ * if duplicates are being dropped.
+ */
+
+#define TOOL_PART (64 << 20)            /* smallest part worth a process */
+#define TOOL_BLOCK (1 << 20)            /* output written at a time */
+
+struct input {
+  const char *base, *end;               /* mapping */
+  const char *next;                     /* where the next record starts */
+  const char *start;                    /* current record, with timestamp */
+  const char *line;                     /* ...the line itself */
+  size_t len;
+  long long ts;                         /* its timestamp */
+  int index;                            /* which input this is */
+};
+
+/* the latest appearance of a line, as reported by the first pass */
+struct last {
+  uint64_t hash;                        /* line's hash, or 0 if unused */
+  uint64_t where;                       /* record's input and offset */
+  long long ts;                         /* record's timestamp */
+};
+
+/* struct last's where field */
+#define TOOL_INPUTS_MAX 65535
+#define WHERE(index, offset) ((uint64_t)(index) << 48 | (offset))
+#define WHERE_INDEX(where) ((int)((where) >> 48))
+#define WHERE_OFFSET(where) ((where) & (((uint64_t)1 << 48) - 1))
+
+/* part of an input, for the first pass */
+struct part {
+  struct input *in;
+  const char *begin, *end;
+  FILE *results;                        /* what the scan found */
+};
+
+struct table {
+  struct last *slots;
+  size_t nslots, nused;
+};
+
+static regex_t match;
+static int matching;                    /* set if only matches are kept */
+
+/* where a compressed input is decoded to */
+struct decoded {
+  FILE *fp;
+  off_t complete;                       /* size without incomplete members */
+};
+
+/* history_decode() callback for map_input() */
+static void decoded(void *u, const char *s, size_t n) {
+  struct decoded *d = u;
+
+  if(!s)
+    d->complete = ftello(d->fp);
+  else if(fwrite(s, 1, n, d->fp) != n)
+    fatal(errno, "error writing temporary file");
+}
+
+/* map fd, which is path or a decoded copy of it */
+static const char *map_fd(int fd, const char *path, size_t *sizep) {
+  struct stat sb;
+  const char *base;
+
+  if(fstat(fd, &sb) < 0)
+    fatal(errno, "error calling fstat");
+  if((uint64_t)sb.st_size >> 48)
+    fatal(0, "%s is too big", path);
+  if(!(*sizep = sb.st_size))
+    return "";
+  if((base = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+     == MAP_FAILED)
+    fatal(errno, "error mapping %s", path);
+  madvise((void *)base, sb.st_size, MADV_SEQUENTIAL);
+  return base;
+}
+
+static void map_input(struct input *in, const char *path, int index) {
+  struct decoded d;
+  size_t size;
+  int fd;
+
+  memset(in, 0, sizeof *in);
+  in->index = index;
+  if((fd = open(path, O_RDONLY)) < 0)
+    fatal(errno, "error opening %s", path);
+  in->base = map_fd(fd, path, &size);
+  xclose(fd);
+  if(!history_plain(in->base, size)) {
+    /* compressed; decode it to a temporary file and use that instead */
+    if(!(d.fp = tmpfile()))
+      fatal(errno, "error creating temporary file");
+    d.complete = 0;
+    history_decode(in->base, size, decoded, &d);
+    if(fflush(d.fp) < 0 || ftruncate(fileno(d.fp), d.complete) < 0)
+      fatal(errno, "error writing temporary file");
+    munmap((void *)in->base, size);
+    in->base = map_fd(fileno(d.fp), path, &size);
+    fclose(d.fp);
+  }
+  in->end = in->base + size;
+  in->next = in->base;
+}
+
+/* true if s..e is a timestamp line */
+static int is_timestamp(const char *s, const char *e) {
+  return e - s > 1 && s[0] == '#' && s[1] >= '0' && s[1] <= '9';
+}
+
+/* step to the next record.  Returns 0 at the end. */
+static int next_record(struct input *in) {
+  const char *s, *e, *ts = 0;
+
+  for(s = in->next; s < in->end; s = e + 1) {
+    if(!(e = memchr(s, '\n', in->end - s)))
+      e = in->end;                      /* last line has no newline */
+    if(is_timestamp(s, e)) {
+      ts = s;
+      in->ts = strtoll(s + 1, 0, 10);
+    } else if(e > s) {
+      in->start = ts ? ts : s;
+      in->line = s;
+      in->len = e - s;
+      in->next = e + 1;
+      return 1;
+    } else
+      ts = 0;
+  }
+  in->next = in->end;
+  return 0;
+}
+
+/* true if the current record of in passes the filter */
+static int wanted(const struct input *in) {
+  static char *l;
+  static size_t size;
+
+  if(!matching)
+    return 1;
+  /* regexec() wants a string */
+  if(in->len + 1 > size) {
+    size = in->len + 256;
+    l = xrealloc(l, size);
+  }
+  memcpy(l, in->line, in->len);
+  l[in->len] = 0;
+  return !regexec(&match, l, 0, 0, 0);
+}
+
+static uint64_t line_hash(const struct input *in) {
+  uint64_t h = hash_string(14695981039346656037ULL, in->line, in->len);
+
+  return h ? h : 1;
+}
+
+/* return the start of the first record of in at or after p */
+static const char *record_start(const struct input *in, const char *p) {
+  const char *l, *prev;
+
+  if(p <= in->base)
+    return in->base;
+  if(!(l = memchr(p - 1, '\n', in->end - (p - 1))))
+    return in->end;
+  ++l;
+  /* a timestamp belongs to the record after it */
+  prev = memrchr(in->base, '\n', l - 1 - in->base);
+  prev = prev ? prev + 1 : in->base;
+  return is_timestamp(prev, l - 1) ? prev : l;
+}
+
+/* return the timestamp in force at p */
+static long long timestamp_at(const struct input *in, const char *p) {
+  const char *s, *e = p;
+
+  while(e > in->base) {
+    s = memrchr(in->base, '\n', e - 1 - in->base);
+    s = s ? s + 1 : in->base;
+    if(is_timestamp(s, e - 1))
+      return strtoll(s + 1, 0, 10);
+    e = s;
+  }
+  return 0;
+}
+
+/* true if a is a later use of a line than b.  Timestamps only matter for
+ * lines in more than one input. */
+static int later(const struct last *a, const struct last *b) {
+  if(WHERE_INDEX(a->where) != WHERE_INDEX(b->where) && a->ts != b->ts)
+    return a->ts > b->ts;
+  return a->where > b->where;
+}
+
+/* return the slot for hash */
+static struct last *slot(struct table *t, uint64_t hash) {
+  size_t i = hash % t->nslots;
+
+  while(t->slots[i].hash && t->slots[i].hash != hash)
+    i = (i + 1) % t->nslots;
+  return &t->slots[i];
+}
+
+/* note an appearance of a line, keeping the latest */
+static void remember(struct table *t, const struct last *l) {
+  struct last *old = t->slots, *s;
+  size_t oldslots = t->nslots, n;
+
+  if(2 * (t->nused + 1) > t->nslots) {
+    t->nslots = t->nslots ? 2 * t->nslots : 4096;
+    t->slots = xmalloc(t->nslots * sizeof *t->slots);
+    memset(t->slots, 0, t->nslots * sizeof *t->slots);
+    for(n = 0; n < oldslots; ++n)
+      if(old[n].hash)
+        *slot(t, old[n].hash) = old[n];
+    free(old);
+  }
+  s = slot(t, l->hash);
+  if(!s->hash) {
+    *s = *l;
+    ++t->nused;
+  } else if(later(l, s))
+    *s = *l;
+}
+
+/* first pass over in from begin to end: write the number of records that
+ * pass the filter to fp, followed by the last appearance of each line if
+ * erasedups is set */
+static void scan(struct input *in, const char *begin, const char *end,
+                 int erasedups, FILE *fp) {
+  struct table t;
+  struct last l;
+  uint64_t count = 0;
+  size_t n;
+
+  memset(&t, 0, sizeof t);
+  in->next = begin;
+  in->end = end;
+  in->ts = timestamp_at(in, begin);
+  while(next_record(in))
+    if(wanted(in)) {
+      ++count;
+      if(erasedups) {
+        l.hash = line_hash(in);
+        l.where = WHERE(in->index, in->start - in->base);
+        l.ts = in->ts;
+        remember(&t, &l);
+      }
+    }
+  fwrite(&count, sizeof count, 1, fp);
+  for(n = 0; n < t.nslots; ++n)
+    if(t.slots[n].hash)
+      fwrite(&t.slots[n], sizeof t.slots[n], 1, fp);
+  if(fflush(fp) < 0)
+    _exit(1);
+}
+
+/* Run the first pass over all the inputs.  Returns the number of records
+ * that will survive, and fills in t if erasedups is set. */
+static uint64_t first_pass(struct input *inputs, int ninputs,
+                           int erasedups, struct table *t) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct part *parts = 0;
+  size_t nparts = 0, size, n, m, k;
+  uint64_t count, total = 0;
+  struct last l;
+  int running = 0, w;
+  pid_t pid;
+
+  if(cpus < 1) cpus = 1;
+  /* split the inputs up at record boundaries */
+  for(n = 0; n < (size_t)ninputs; ++n) {
+    size = inputs[n].end - inputs[n].base;
+    if((k = size / TOOL_PART) > (size_t)cpus) k = cpus;
+    if(!k) k = 1;
+    parts = xrealloc(parts, (nparts + k) * sizeof *parts);
+    for(m = 0; m < k; ++m) {
+      parts[nparts + m].in = &inputs[n];
+      parts[nparts + m].begin = m ? parts[nparts + m - 1].end
+        : inputs[n].base;
+      parts[nparts + m].end = m + 1 < k
+        ? record_start(&inputs[n], inputs[n].base + size / k * (m + 1))
+        : inputs[n].end;
+    }
+    nparts += k;
+  }
+  for(n = 0; n < nparts; ++n) {
+    if(running == cpus) {
+      /* wait for a slot to come free */
+      while((pid = wait(&w)) < 0 && errno == EINTR)
+        ;
+      if(pid < 0) fatal(errno, "error calling wait");
+      if(w) fatal(0, "history scan failed");
+      --running;
+    }
+    if(!(parts[n].results = tmpfile()))
+      fatal(errno, "error creating temporary file");
+    switch(fork()) {
+    case -1:
+      fatal(errno, "error calling fork");
+    case 0:
+      scan(parts[n].in, parts[n].begin, parts[n].end, erasedups,
+           parts[n].results);
+      _exit(0);
+    }
+    ++running;
+  }
+  while(running--) {
+    while((pid = wait(&w)) < 0 && errno == EINTR)
+      ;
+    if(pid < 0) fatal(errno, "error calling wait");
+    if(w) fatal(0, "history scan failed");
+  }
+  /* combine the results */
+  for(n = 0; n < nparts; ++n) {
+    rewind(parts[n].results);
+    if(fread(&count, sizeof count, 1, parts[n].results) != 1)
+      fatal(errno, "error reading scan results");
+    total += count;
+    while(fread(&l, sizeof l, 1, parts[n].results) == 1)
+      remember(t, &l);
+    fclose(parts[n].results);
+  }
+  free(parts);
+  return erasedups ? t->nused : total;
+}
+
+/* the merge heap, ordered by timestamp and then input */
+static int before(const struct input *a, const struct input *b) {
+  return a->ts != b->ts ? a->ts < b->ts : a->index < b->index;
+}
+
+static void sift_down(struct input **heap, int nheap, int n) {
+  struct input *in = heap[n];
+  int c;
+
+  while((c = 2 * n + 1) < nheap) {
+    if(c + 1 < nheap && before(heap[c + 1], heap[c]))
+      ++c;
+    if(!before(heap[c], in))
+      break;
+    heap[n] = heap[c];
+    n = c;
+  }
+  heap[n] = in;
+}
+
+/* write out some of the output, compressing it if necessary */
+static void write_block(struct buffer *block, FILE *fp) {
+  struct buffer z;
+
+  if(block->start == block->end)
+    return;
+  if(history_compress) {
+    buffer_init(&z);
+    history_encode(block->start, block->end - block->start, &z);
+    fwrite(z.start, 1, z.end - z.start, fp);
+    free(z.base);
+  } else
+    fwrite(block->start, 1, block->end - block->start, fp);
+  buffer_clear(block);
+}
+
+/* Merge the history files in paths[0..npaths) and write the result to
+ * output, which may be one of the inputs.  If pattern is not a null pointer
+ * then only lines matching it are kept.  If erasedups is set then only
+ * the latest of identical lines is kept.  If max is positive then only
+ * the newest max records are kept. */
+void history_tool(const char *output, char **paths, int npaths,
+                  const char *pattern, int erasedups, long max) {
+  struct input *in = xmalloc((npaths ? npaths : 1) * sizeof *in);
+  struct input **heap = xmalloc((npaths ? npaths : 1) * sizeof *heap);
+  struct input *cur;
+  struct table t;
+  struct last *s;
+  struct buffer block;
+  uint64_t survivors = 0, skip = 0;
+  int n, nheap = 0, keep, err, fd;
+  char *tmp, msg[256];
+  FILE *fp;
+
+  if(pattern) {
+    if((err = regcomp(&match, pattern, REG_EXTENDED|REG_NOSUB))) {
+      regerror(err, &match, msg, sizeof msg);
+      fatal(0, "invalid regexp '%s': %s", pattern, msg);
+    }
+    matching = 1;
+  }
+  if(npaths > TOOL_INPUTS_MAX)
+    fatal(0, "too many history files");
+  for(n = 0; n < npaths; ++n)
+    map_input(&in[n], paths[n], n);
+  memset(&t, 0, sizeof t);
+  if(erasedups || max > 0) {
+    survivors = first_pass(in, npaths, erasedups, &t);
+    if(max > 0 && survivors > (uint64_t)max)
+      skip = survivors - max;
+  }
+  tmp = xmalloc(strlen(output) + 32);
+  sprintf(tmp, "%s.tool.%lu", output, (unsigned long)getpid());
+  if((fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0)
+    fatal(errno, "error creating %s", tmp);
+  if(!(fp = fdopen(fd, "w")))
+    fatal(errno, "error calling fdopen");
+  buffer_init(&block);
+  /* second pass: merge (the first pass ran in other processes, so the
+   * inputs are still at the start) */
+  for(n = 0; n < npaths; ++n)
+    if(next_record(&in[n]))
+      heap[nheap++] = &in[n];
+  for(n = nheap / 2; n-- > 0;)
+    sift_down(heap, nheap, n);
+  while(nheap) {
+    cur = heap[0];
+    if(erasedups) {
+      /* the first pass only reported wanted lines */
+      s = slot(&t, line_hash(cur));
+      keep = s->hash
+        && s->where == WHERE(cur->index, cur->start - cur->base);
+    } else
+      keep = wanted(cur);
+    if(keep) {
+      if(skip)
+        --skip;
+      else {
+        buffer_append(&block, cur->start, cur->line + cur->len - cur->start);
+        buffer_append(&block, "\n", 1);
+        if(block.end - block.start >= TOOL_BLOCK)
+          write_block(&block, fp);
+      }
+    }
+    if(!next_record(cur))
+      heap[0] = heap[--nheap];
+    if(nheap)
+      sift_down(heap, nheap, 0);
+  }
+  write_block(&block, fp);
+  if(fflush(fp) < 0 || ferror(fp) || fsync(fd) < 0 || fclose(fp) < 0
+     || rename(tmp, output) < 0) {
+    err = errno;
+    unlink(tmp);
+    fatal(err, "error writing %s", output);
+  }
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
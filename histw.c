@@ -0,0 +1,305 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Background history writer.
+ *
+ * Appending to the history file after every line means opening, writing and
+ * closing a file (perhaps on NFS) between the user hitting Enter and the
+ * command seeing the line.  Instead we hand each record to a child process
+ * over a socket, framed as:
+ *
+ *   u32 PATHLEN, u32 DATALEN, PATH, DATA
+ *
+ * The writer appends DATA to PATH according to the sync policy: as soon as
+ * it arrives, every HISTW_PERIOD seconds, or when we exit (i.e. when the
+ * socket reaches EOF, which also happens if we die).
+ *
+ * If a spool directory is given then the writer appends to a file there
+ * instead and merges it into PATH at exit.
+ */
+
+#define HISTW_PERIOD 5                  /* seconds between interval syncs */
+#define HISTW_BATCH_MAX 1048576         /* flush anyway beyond this */
+
+struct target {
+  struct target *next;
+  char *path;                           /* history file */
+  char *spool;                          /* spool file or 0 */
+  struct buffer pending;                /* not written yet */
+};
+
+static int histw_conn = -1;             /* socket to writer */
+static pid_t histw_pid;                 /* writer process */
+
+static int errors;                      /* write errors */
+static int last_error;                  /* errno value of the last one */
+static const char *last_path;           /* file of the last one */
+
+static void failed(const char *path, int err) {
+  ++errors;
+  last_error = err;
+  last_path = path;
+}
+
+/* append the pending data for t to path */
+static void flush(struct target *t) {
+  const char *path = t->spool ? t->spool : t->path;
+  int fd, err;
+
+  if(t->pending.start == t->pending.end)
+    return;
+  if((fd = history_open_append(path)) < 0) {
+    failed(path, errno);
+  } else {
+    if((err = do_writen(fd, t->pending.start,
+                        t->pending.end - t->pending.start)))
+      failed(path, err);
+    if(close(fd) < 0)
+      failed(path, errno);
+  }
+  /* there's no sensible way to retry, so failures are just counted */
+  buffer_clear(&t->pending);
+}
+
+/* move t's spool file into its history file */
+static void merge(struct target *t) {
+  struct buffer b;
+  char buf[4096], *spool;
+  int fd, err = 0, before;
+  ssize_t n;
+
+  if(!t->spool)
+    return;
+  if((fd = open(t->spool, O_RDONLY)) < 0) {
+    if(errno != ENOENT)
+      failed(t->spool, errno);
+    return;
+  }
+  buffer_init(&b);
+  while((n = read(fd, buf, sizeof buf)) != 0) {
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      err = errno;
+      break;
+    }
+    buffer_append(&b, buf, n);
+  }
+  close(fd);
+  if(err)
+    failed(t->spool, err);
+  else {
+    /* a single append, so concurrent sessions don't interleave */
+    buffer_append(&t->pending, b.start, b.end - b.start);
+    spool = t->spool;
+    t->spool = 0;
+    before = errors;
+    flush(t);
+    if(errors == before)
+      unlink(spool);
+    else
+      fprintf(stderr, "with-readline: history left in %s\n", spool);
+    free(spool);
+  }
+  free(b.base);
+}
+
+static struct target *find_target(struct target **targets, const char *path,
+                                  const char *spooldir) {
+  struct target *t;
+  const char *base;
+
+  for(t = *targets; t && strcmp(t->path, path); t = t->next)
+    ;
+  if(!t) {
+    t = xmalloc(sizeof *t);
+    t->path = xstrdup(path);
+    t->spool = 0;
+    if(spooldir) {
+      base = (base = strrchr(path, '/')) ? base + 1 : path;
+      t->spool = xmalloc(strlen(spooldir) + strlen(base) + 32);
+      sprintf(t->spool, "%s/%s.%lu",
+              spooldir, base, (unsigned long)getpid());
+    }
+    buffer_init(&t->pending);
+    t->next = *targets;
+    *targets = t;
+  }
+  return t;
+}
+
+/* the writer's main loop */
+static void writer(int fd, int policy, const char *spooldir) {
+  struct target *targets = 0, *t;
+  struct buffer in;
+  struct timeval tv;
+  struct timespec since;                /* when waiting became nonzero */
+  uint32_t hdr[2];
+  char buf[4096], *path;
+  size_t avail, waiting = 0;
+  fd_set fds;
+  long left;
+  int n;
+
+  buffer_init(&in);
+  for(;;) {
+    if(policy == HISTW_SYNC_INTERVAL && waiting) {
+      /* the period runs from the oldest record not yet written, so a
+       * steady stream of them doesn't put it off */
+      if((left = HISTW_PERIOD * 1000L - ms_since(&since)) <= 0) {
+        for(t = targets; t; t = t->next)
+          flush(t);
+        waiting = 0;
+        continue;
+      }
+      tv.tv_sec = left / 1000;
+      tv.tv_usec = left % 1000 * 1000;
+    }
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    n = select(fd + 1, &fds, 0, 0,
+               policy == HISTW_SYNC_INTERVAL && waiting ? &tv : 0);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      fatal(errno, "error calling select");
+    }
+    if(n == 0)
+      continue;                         /* the period is up */
+    n = read(fd, buf, sizeof buf);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    if(n == 0)
+      break;
+    buffer_append(&in, buf, n);
+    /* process complete records */
+    while((avail = in.end - in.start) >= sizeof hdr) {
+      memcpy(hdr, in.start, sizeof hdr);
+      if(avail < sizeof hdr + hdr[0] + hdr[1])
+        break;
+      path = xmalloc(hdr[0] + 1);
+      memcpy(path, in.start + sizeof hdr, hdr[0]);
+      path[hdr[0]] = 0;
+      t = find_target(&targets, path, spooldir);
+      free(path);
+      buffer_append(&t->pending, in.start + sizeof hdr + hdr[0], hdr[1]);
+      in.start += sizeof hdr + hdr[0] + hdr[1];
+      if(!waiting)
+        monotonic(&since);
+      waiting += hdr[1];
+      if(policy == HISTW_SYNC_EVERY || waiting > HISTW_BATCH_MAX) {
+        flush(t);
+        waiting = 0;
+      }
+    }
+    /* move any partial record down, so the next read doesn't have to
+     * grow the buffer */
+    avail = in.end - in.start;
+    memmove(in.base, in.start, avail);
+    in.start = in.base;
+    in.end = in.base + avail;
+  }
+  /* our parent has finished (or died) */
+  for(t = targets; t; t = t->next) {
+    flush(t);
+    merge(t);
+  }
+  if(errors)
+    fprintf(stderr, "with-readline: %d error%s writing history"
+            " (last: %s: %s)\n",
+            errors, errors == 1 ? "" : "s",
+            last_path, strerror(last_error));
+}
+
+/* Start the background writer.  policy is one of the HISTW_SYNC_ values;
+ * spooldir is a directory to spool to, or 0. */
+void histw_start(int policy, const char *spooldir) {
+  int sv[2], fd;
+
+  if(socketpair(PF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    fatal(errno, "error calling socketpair");
+  switch(histw_pid = fork()) {
+  case -1:
+    fatal(errno, "error calling fork");
+  case 0:
+    exitfn = _exit;
+    /* don't hang on to the pty or anything else, and don't die with the
+     * terminal before we've written everything out */
+    for(fd = getdtablesize() - 1; fd > 2; --fd)
+      if(fd != sv[1])
+        close(fd);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    writer(sv[1], policy, spooldir);
+    _exit(0);
+  }
+  xclose(sv[1]);
+  cloexec(sv[0]);
+  histw_conn = sv[0];
+}
+
+/* Queue n bytes of data to be appended to path.  Returns 0 on success or an
+ * errno value, in which case the caller should do it itself. */
+int histw_append(const char *path, const char *data, size_t n) {
+  uint32_t hdr[2];
+  struct buffer b;
+  int err;
+
+  if(histw_conn == -1)
+    return ENOTCONN;
+  hdr[0] = strlen(path);
+  hdr[1] = n;
+  buffer_init(&b);
+  buffer_append(&b, hdr, sizeof hdr);
+  buffer_append(&b, path, hdr[0]);
+  buffer_append(&b, data, n);
+  /* a dead writer is an error, not a fatal SIGPIPE */
+  if((err = send_all(histw_conn, b.start, b.end - b.start))) {
+    close(histw_conn);
+    histw_conn = -1;
+  }
+  free(b.base);
+  return err;
+}
+
+/* Tell the writer we've finished and wait for it to write everything out. */
+void histw_finish(void) {
+  int status;
+
+  if(histw_conn == -1)
+    return;
+  xclose(histw_conn);
+  histw_conn = -1;
+  while(waitpid(histw_pid, &status, 0) < 0 && errno == EINTR)
+    ;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
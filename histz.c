@@ -0,0 +1,182 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#if HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
+/* Compressed history files.
+ *
+ * A compressed history file is a sequence of gzip members, so it can still
+ * be read with zcat.  Each line is appended as a member of its own, which
+ * costs a little more space than the line itself would; compaction writes
+ * everything it keeps as one member, which is where the space is saved.
+ *
+ * Plain text and members can be mixed.  That happens when compression is
+ * turned on or off for an existing history file, and lasts until it's next
+ * compacted.  Members always start at the start of a line.
+ */
+
+int history_compress;                   /* set to write compressed history */
+
+#define HISTZ_CHUNK 65536               /* output passed on at a time */
+
+/* true if p starts a gzip member */
+static int is_member(const char *p, const char *end) {
+  return end - p >= 2 && (unsigned char)p[0] == 0x1f
+    && (unsigned char)p[1] == 0x8b;
+}
+
+/* True if data[0..n) can be treated as plain text without decoding it.
+ * Appended members generally end in a 0 byte, so a file that doesn't end
+ * with a newline is decoded to be on the safe side. */
+int history_plain(const char *data, size_t n) {
+  return !n || (!is_member(data, data + n) && data[n - 1] == '\n');
+}
+
+#if HAVE_ZLIB_H
+/* decode the member at p, passing output to fn.  Returns where the next
+ * member starts, or a null pointer if it is incomplete or corrupt. */
+static const char *inflate_member(const char *p, const char *end,
+                                  void (*fn)(void *u, const char *s,
+                                             size_t n),
+                                  void *u) {
+  char out[HISTZ_CHUNK];
+  z_stream z;
+  int r;
+
+  memset(&z, 0, sizeof z);
+  if(inflateInit2(&z, 15 + 16) != Z_OK)
+    fatal(0, "error calling inflateInit2");
+  z.next_in = (Bytef *)p;
+  z.avail_in = end - p;
+  do {
+    z.next_out = (Bytef *)out;
+    z.avail_out = sizeof out;
+    r = inflate(&z, Z_NO_FLUSH);
+    if(r != Z_OK && r != Z_STREAM_END)
+      break;
+    if(z.avail_out < sizeof out)
+      fn(u, out, sizeof out - z.avail_out);
+  } while(r != Z_STREAM_END);
+  inflateEnd(&z);
+  return r == Z_STREAM_END ? p + z.total_in : 0;
+}
+#endif
+
+/* Decode the history in data[0..n), which may be plain text, compressed,
+ * or a mixture, passing the text to fn in pieces.  After each complete
+ * member or run of plain lines, fn is called with a null pointer.
+ * Returns the number of bytes of data that were complete. */
+size_t history_decode(const char *data, size_t n,
+                      void (*fn)(void *u, const char *s, size_t n),
+                      void *u) {
+  const char *p = data, *end = data + n, *q, *nl;
+
+  while(p < end) {
+    if(is_member(p, end)) {
+#if HAVE_ZLIB_H
+      if(!(q = inflate_member(p, end, fn, u)))
+        break;
+#else
+      break;                            /* can't read it */
+#endif
+    } else {
+      /* plain text runs up to the next member */
+      for(q = p; (nl = memchr(q, '\n', end - q)); ) {
+        q = nl + 1;
+        if(is_member(q, end))
+          break;
+      }
+      if(q == p)
+        break;                          /* incomplete line */
+      fn(u, p, q - p);
+    }
+    fn(u, 0, 0);
+    p = q;
+  }
+  return p - data;
+}
+
+struct text {
+  struct buffer *b;
+  size_t complete;                      /* bytes from complete members */
+};
+
+/* history_decode() callback for history_decode_text() */
+static void append_text(void *u, const char *s, size_t n) {
+  struct text *t = u;
+
+  if(s)
+    buffer_append(t->b, s, n);
+  else
+    t->complete = t->b->end - t->b->start;
+}
+
+/* Decode the history in data[0..n) and append it to b, leaving out any
+ * incomplete member at the end.  Returns the number of bytes of data that
+ * were decoded. */
+size_t history_decode_text(const char *data, size_t n, struct buffer *b) {
+  struct text t;
+  size_t done;
+
+  t.b = b;
+  t.complete = b->end - b->start;
+  done = history_decode(data, n, append_text, &t);
+  b->end = b->start + t.complete;
+  return done;
+}
+
+/* Append data[0..n) to out as a gzip member, or as it is if compression
+ * isn't available. */
+void history_encode(const char *data, size_t n, struct buffer *out) {
+#if HAVE_ZLIB_H
+  char buf[HISTZ_CHUNK];
+  z_stream z;
+  int r;
+
+  memset(&z, 0, sizeof z);
+  if(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                  Z_DEFAULT_STRATEGY) != Z_OK)
+    fatal(0, "error calling deflateInit2");
+  z.next_in = (Bytef *)data;
+  z.avail_in = n;
+  do {
+    z.next_out = (Bytef *)buf;
+    z.avail_out = sizeof buf;
+    if((r = deflate(&z, Z_FINISH)) == Z_STREAM_ERROR)
+      fatal(0, "error calling deflate");
+    buffer_append(out, buf, sizeof buf - z.avail_out);
+  } while(r != Z_STREAM_END);
+  deflateEnd(&z);
+#else
+  buffer_append(out, data, n);
+#endif
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
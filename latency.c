@@ -0,0 +1,297 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#include <sys/mman.h>
+#include <ctype.h>
+
+/* Command latency.
+ *
+ * Each history record gets a timestamp line in the form Bash and Readline
+ * use, with the command's latency in milliseconds after it:
+ *
+ *   #TIME LATENCY
+ *   LINE
+ *
+ * The latency is the time from the line being sent to the command's last
+ * output before its next prompt.  So the record isn't written until the
+ * prompt is recognized or the next line is started.  A command that pauses
+ * part way through its output hasn't finished, so going quiet only counts
+ * after LATENCY_QUIET milliseconds, for commands whose prompts are never
+ * recognized.  If there's no output in between, or the command exits
+ * first, only the time is written.
+ */
+
+#define LATENCY_QUIET 10000             /* silence that ends the output */
+
+static struct {
+  char *line;                           /* line waiting to be written */
+  const char *path;                     /* history file it belongs in */
+  long serial;                          /* its history entry */
+  time_t when;                          /* when it was sent */
+  struct timespec sent;                 /* ...by the monotonic clock */
+} pending;
+
+/* append record to path as a gzip member of its own */
+static void append_compressed(const char *path, const char *record) {
+  struct buffer z;
+  int fd;
+
+  buffer_init(&z);
+  history_encode(record, strlen(record), &z);
+  if(histw_append(path, z.start, z.end - z.start)
+     && (fd = history_open_append(path)) >= 0) {
+    do_writen(fd, z.start, z.end - z.start);
+    close(fd);
+  }
+  free(z.base);
+}
+
+/* write the pending line, with its latency if latency >= 0 */
+static void flush(long latency) {
+  char ts[64], *record;
+  HIST_ENTRY *e;
+  long pos;
+
+  if(latency >= 0)
+    sprintf(ts, "#%ld %ld", (long)pending.when, latency);
+  else
+    sprintf(ts, "#%ld", (long)pending.when);
+  if((pos = hist_position(pending.serial)) >= 0) {
+    e = history_list()[pos];
+    free(e->timestamp);
+    e->timestamp = xstrdup(ts);
+  }
+  record = xmalloc(strlen(ts) + strlen(pending.line) + 3);
+  sprintf(record, "%s\n%s\n", ts, pending.line);
+  if(history_compress)
+    append_compressed(pending.path, record);
+  else if(histd_append(ts, pending.line)
+          && histw_append(pending.path, record, strlen(record)))
+    append_history(1, pending.path);
+  free(record);
+  free(pending.line);
+  pending.line = 0;
+}
+
+/* Note that line, just added to the history, has been sent to the command.
+ * It will be written to path once its latency is known. */
+void latency_sent(const char *path, const char *line) {
+  char ts[32];
+
+  if(pending.line)
+    flush(-1);
+  pending.line = xstrdup(line);
+  pending.path = path;
+  pending.serial = hist_serial(history_length - 1);
+  time(&pending.when);
+  monotonic(&pending.sent);
+  sprintf(ts, "#%ld", (long)pending.when);
+  add_history_time(ts);
+}
+
+/* milliseconds from the pending line being sent to last_output; negative
+ * if there's been no output since */
+static long latency(const struct timespec *last_output) {
+  return (last_output->tv_sec - pending.sent.tv_sec) * 1000L
+    + (last_output->tv_nsec - pending.sent.tv_nsec) / 1000000L;
+}
+
+/* The next line is being started; last_output is when the command last
+ * wrote anything. */
+void latency_prompt(const struct timespec *last_output) {
+  long ms;
+
+  if(pending.line)
+    flush((ms = latency(last_output)) >= 0 ? ms : -1);
+}
+
+/* Write the pending line if the command has written anything since it was
+ * sent, last at last_output, and then either prompted or gone quiet for
+ * good.  Returns how many milliseconds to wait before calling again, or -1
+ * if there's no need. */
+long latency_check(const struct timespec *last_output, int prompted) {
+  long left;
+
+  if(!pending.line || latency(last_output) < 0)
+    return -1;
+  if(!prompted && (left = LATENCY_QUIET - ms_since(last_output)) > 0)
+    return left;
+  latency_prompt(last_output);
+  return -1;
+}
+
+/* Write out anything still pending, without a latency. */
+void latency_finish(void) {
+  if(pending.line)
+    flush(-1);
+}
+
+/* latencies of lines starting with one word */
+struct prefix {
+  long *latencies;
+  size_t n, slots;
+  char word[];
+};
+
+static struct prefix **table;           /* hash table of prefixes */
+static size_t nslots, nprefixes;
+
+/* return the table slot for word */
+static size_t slot(const char *word) {
+  size_t i = hash_string(14695981039346656037ULL, word, strlen(word))
+    % nslots;
+
+  while(table[i] && strcmp(table[i]->word, word))
+    i = (i + 1) % nslots;
+  return i;
+}
+
+/* return the prefix for word, creating it if necessary */
+static struct prefix *find(const char *word) {
+  struct prefix **old = table, *p;
+  size_t oldslots = nslots, i;
+
+  if(2 * (nprefixes + 1) > nslots) {
+    nslots = nslots ? 2 * nslots : 256;
+    table = xmalloc(nslots * sizeof *table);
+    memset(table, 0, nslots * sizeof *table);
+    for(i = 0; i < oldslots; ++i)
+      if(old[i])
+        table[slot(old[i]->word)] = old[i];
+    free(old);
+  }
+  if(!table[i = slot(word)]) {
+    p = xmalloc(sizeof *p + strlen(word) + 1);
+    strcpy(p->word, word);
+    p->latencies = 0;
+    p->n = p->slots = 0;
+    table[i] = p;
+    ++nprefixes;
+  }
+  return table[i];
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* the p'th percentile of sorted values v[0..n), by nearest rank */
+static long percentile(const long *v, size_t n, int p) {
+  size_t rank = (n * p + 99) / 100;
+
+  return v[rank ? rank - 1 : 0];
+}
+
+/* order prefixes by descending p95 */
+static int compare_prefix(const void *a, const void *b) {
+  const struct prefix *x = *(const struct prefix *const *)a;
+  const struct prefix *y = *(const struct prefix *const *)b;
+  long px = percentile(x->latencies, x->n, 95);
+  long py = percentile(y->latencies, y->n, 95);
+
+  return px > py ? -1 : px < py;
+}
+
+/* Print latency percentiles from history file path, for each first word
+ * of a line (ignoring case), slowest first. */
+void latency_report(const char *path) {
+  struct stat sb;
+  struct prefix *p, **all;
+  struct buffer text;
+  const char *base, *end, *s, *e, *w, *latency = 0;
+  size_t n, len;
+  char *stop, word[64];
+  long ms;
+  int fd;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    fatal(errno, "error opening %s", path);
+  if(fstat(fd, &sb) < 0)
+    fatal(errno, "error calling fstat");
+  if(!sb.st_size)
+    base = "";
+  else if((base = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+          == MAP_FAILED)
+    fatal(errno, "error mapping %s", path);
+  xclose(fd);
+  end = base + sb.st_size;
+  if(!history_plain(base, sb.st_size)) {
+    buffer_init(&text);
+    history_decode_text(base, sb.st_size, &text);
+    base = text.start;
+    end = text.end;
+  }
+  for(s = base; (e = memchr(s, '\n', end - s)); s = e + 1) {
+    if(e - s > 1 && s[0] == '#' && s[1] >= '0' && s[1] <= '9') {
+      latency = memchr(s, ' ', e - s);
+      continue;
+    }
+    if(!latency)
+      continue;
+    w = latency + 1;
+    latency = 0;
+    if((ms = strtol(w, &stop, 10)) < 0 || stop == w)
+      continue;
+    /* the first word of the line, folded to lower case */
+    for(w = s; w < e && (*w == ' ' || *w == '\t'); ++w)
+      ;
+    for(len = 0; w + len < e && len < sizeof word - 1
+          && !strchr(" \t;(", w[len]); ++len)
+      word[len] = tolower((unsigned char)w[len]);
+    if(!len)
+      continue;
+    word[len] = 0;
+    p = find(word);
+    if(p->n == p->slots) {
+      p->slots = p->slots ? 2 * p->slots : 16;
+      p->latencies = xrealloc(p->latencies,
+                              p->slots * sizeof *p->latencies);
+    }
+    p->latencies[p->n++] = ms;
+  }
+  all = xmalloc((nprefixes ? nprefixes : 1) * sizeof *all);
+  for(len = n = 0; len < nslots; ++len)
+    if((p = table[len])) {
+      qsort(p->latencies, p->n, sizeof *p->latencies, compare_long);
+      all[n++] = p;
+    }
+  qsort(all, n, sizeof *all, compare_prefix);
+  xprintf("%-20s %8s %10s %10s %10s\n", "COMMAND", "COUNT",
+          "P50/ms", "P95/ms", "P99/ms");
+  for(len = 0; len < n; ++len)
+    xprintf("%-20s %8lu %10ld %10ld %10ld\n", all[len]->word,
+            (unsigned long)all[len]->n,
+            percentile(all[len]->latencies, all[len]->n, 50),
+            percentile(all[len]->latencies, all[len]->n, 95),
+            percentile(all[len]->latencies, all[len]->n, 99));
+  xfclose(stdout);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
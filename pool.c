@@ -0,0 +1,311 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Warm pool of pre-spawned commands.
+ *
+ * A broker process, one per (working directory, command line) pair, keeps
+ * pool_size instances of the command running on their own ptys, soaking up
+ * their startup output.  A --pooled launch connects to the broker, which
+ * passes it the pty master, the child's PID and everything the child has
+ * printed so far, and then starts a replacement.  The broker remains the
+ * child's parent, so it reports the wait status back over the same
+ * connection when the child terminates.
+ */
+
+#define POOL_OUTPUT_MAX 65536           /* max startup output to soak up */
+#define POOL_IDLE 3600                  /* broker lifetime without adoptions */
+#define POOL_FAILURES 3                 /* quick deaths before giving up */
+
+struct spare {
+  struct spare *next;
+  pid_t pid;                            /* child process */
+  int ptm;                              /* pty master or -1 */
+  int conn;                             /* adopting client or -1 */
+  time_t started;                       /* when it was started */
+  struct buffer output;                 /* output so far */
+};
+
+/* what the broker tells an adopting client (the pty master is attached) */
+struct handoff {
+  pid_t pid;                            /* child process */
+  size_t outlen;                        /* bytes of output that follow */
+};
+
+static int pool_conn = -1;              /* connection to broker */
+static int chldpipe[2];                 /* SIGCHLD notifications */
+
+/* path to the broker socket for argv in the current directory */
+static char *pool_path(char **argv) {
+  char cwd[PATH_MAX], *path;
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+  if(!getcwd(cwd, sizeof cwd))
+    fatal(errno, "error calling getcwd");
+  h = hash_string(h, cwd, strlen(cwd) + 1);
+  while(*argv) {
+    h = hash_string(h, *argv, strlen(*argv) + 1);
+    ++argv;
+  }
+  path = xmalloc(strlen(rundir()) + 64);
+  sprintf(path, "%s/pool-%016llx", rundir(), (unsigned long long)h);
+  return path;
+}
+
+static void chldhandler(int attribute((unused)) sig) {
+  int save = errno;
+
+  write(chldpipe[1], "", 1);
+  errno = save;
+}
+
+/* start a new spare instance of the command */
+static struct spare *spawn_spare(char **argv, const struct termios *t,
+                                 const struct winsize *w) {
+  struct spare *s;
+  char *ptspath, buf[1];
+  int p[2];
+
+  s = xmalloc(sizeof *s);
+  memset(s, 0, sizeof *s);
+  buffer_init(&s->output);
+  s->conn = -1;
+  make_terminal(&s->ptm, &ptspath);
+  cloexec(s->ptm);
+  /* the same handshake as main() so that we don't see a spurious EOF */
+  if(pipe(p) < 0) fatal(errno, "error creating pipe");
+  switch(s->pid = fork()) {
+  case -1:
+    fatal(errno, "error calling fork");
+  case 0:
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    setup_child(ptspath, t, w);
+    xclose(p[0]);
+    xclose(p[1]);
+    execvp(argv[0], argv);
+    fatal(errno, "error executing %s", argv[0]);
+  }
+  xclose(p[1]);
+  read(p[0], buf, 1);
+  xclose(p[0]);
+  free(ptspath);
+  time(&s->started);
+  return s;
+}
+
+/* hand the oldest spare to a newly connected client */
+static void adopt(struct spare *spares, int conn) {
+  struct spare *s, *chosen = 0;
+  struct handoff h;
+  char req;
+  int err;
+
+  if(do_readn(conn, &req, 1)) {
+    xclose(conn);
+    return;
+  }
+  for(s = spares; s; s = s->next)
+    if(s->ptm != -1 && s->conn == -1)
+      chosen = s;                       /* list is newest-first */
+  if(!chosen) {
+    xclose(conn);                       /* client will start its own */
+    return;
+  }
+  h.pid = chosen->pid;
+  h.outlen = chosen->output.end - chosen->output.start;
+  if((err = send_fd(conn, chosen->ptm, &h, sizeof h))
+     || (err = do_writen(conn, chosen->output.start, h.outlen))) {
+    xclose(conn);
+    return;
+  }
+  xclose(chosen->ptm);
+  chosen->ptm = -1;
+  chosen->conn = conn;
+  free(chosen->output.base);
+  buffer_init(&chosen->output);
+}
+
+/* the broker's main loop.  Never returns. */
+static void broker(int listenfd, const char *path, char **argv, int size,
+                   const struct termios *t, const struct winsize *w) {
+  struct spare *spares = 0, *s, **ss;
+  time_t last;
+  struct timeval tv;
+  struct sigaction sa;
+  fd_set fds;
+  int max, n, conn, live, failures = 0;
+  char buf[4096];
+  pid_t pid;
+
+  if(pipe(chldpipe) < 0) fatal(errno, "error creating pipe");
+  cloexec(chldpipe[0]);
+  cloexec(chldpipe[1]);
+  sa.sa_handler = chldhandler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if(sigaction(SIGCHLD, &sa, 0) < 0)
+    fatal(errno, "error installing signal handler");
+  time(&last);
+  for(;;) {
+    for(live = 0, s = spares; s; s = s->next)
+      if(s->conn == -1) ++live;
+    while(live++ < size) {
+      s = spawn_spare(argv, t, w);
+      s->next = spares;
+      spares = s;
+    }
+    FD_ZERO(&fds);
+    FD_SET(listenfd, &fds);
+    FD_SET(chldpipe[0], &fds);
+    max = listenfd > chldpipe[0] ? listenfd : chldpipe[0];
+    for(s = spares; s; s = s->next)
+      if(s->ptm != -1 && s->output.end - s->output.start < POOL_OUTPUT_MAX) {
+        FD_SET(s->ptm, &fds);
+        if(s->ptm > max) max = s->ptm;
+      }
+    tv.tv_sec = last + POOL_IDLE - time(0);
+    tv.tv_usec = 0;
+    if(tv.tv_sec <= 0) {
+      /* nobody wants us; only leave once adopted children are reported */
+      for(s = spares; s && s->conn == -1; s = s->next)
+        ;
+      if(!s) break;
+      tv.tv_sec = POOL_IDLE;
+    }
+    n = select(max + 1, &fds, 0, 0, &tv);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      fatal(errno, "error calling select");
+    }
+    if(n == 0) continue;
+    if(FD_ISSET(listenfd, &fds)) {
+      if((conn = accept(listenfd, 0, 0)) >= 0) {
+        cloexec(conn);
+        adopt(spares, conn);
+        time(&last);
+      }
+    }
+    for(s = spares; s; s = s->next)
+      if(s->ptm != -1 && FD_ISSET(s->ptm, &fds)) {
+        n = read(s->ptm, buf, sizeof buf);
+        if(n > 0)
+          buffer_append(&s->output, buf, n);
+        else if(n == 0 || (errno != EINTR && errno != EAGAIN)) {
+          /* the spare has gone away; we'll reap it below */
+          xclose(s->ptm);
+          s->ptm = -1;
+        }
+      }
+    if(FD_ISSET(chldpipe[0], &fds)) {
+      read(chldpipe[0], buf, sizeof buf);
+      while((pid = waitpid(-1, &n, WNOHANG)) > 0) {
+        for(ss = &spares; (s = *ss) && s->pid != pid; ss = &s->next)
+          ;
+        if(!s) continue;
+        if(s->conn != -1) {
+          /* an adopted child: tell the client how it went */
+          do_writen(s->conn, (char *)&n, sizeof n);
+          xclose(s->conn);
+        } else if(time(0) - s->started < 2 && ++failures >= POOL_FAILURES)
+          size = 0;                     /* keeps dying, stop replacing it */
+        if(s->ptm != -1) xclose(s->ptm);
+        free(s->output.base);
+        *ss = s->next;
+        free(s);
+      }
+    }
+  }
+  /* closing the masters hangs up the spares */
+  unlink(path);
+  exit(0);
+}
+
+/* Try to adopt a pre-spawned instance of argv.  On success returns 1 and
+ * sets *ptmp, *pidp and appends the child's output so far to *output.  On
+ * failure returns 0, having started a broker for next time if there wasn't
+ * one already. */
+int pool_adopt(char **argv, int size, const struct termios *t,
+               const struct winsize *w, int *ptmp, pid_t *pidp,
+               struct buffer *output) {
+  char *path, *buf;
+  struct handoff h;
+  struct termios child_termios;
+  int fd, listenfd, err;
+
+  path = pool_path(argv);
+  if((fd = unix_connect(path)) >= 0) {
+    if(!do_writen(fd, "A", 1)
+       && !recv_fd(fd, ptmp, &h, sizeof h)
+       && *ptmp != -1) {
+      buf = xmalloc(h.outlen + 1);
+      if((err = do_readn(fd, buf, h.outlen)))
+        fatal(err, "error reading from pool broker");
+      buffer_append(output, buf, h.outlen);
+      free(buf);
+      /* the spare was started with whatever terminal its broker's first
+       * client had; bring it into line with ours */
+      child_termios = *t;
+      child_termios.c_lflag &= ~ECHO;
+      if(tcsetattr(*ptmp, TCSANOW, &child_termios) < 0)
+        fatal(errno, "error calling tcsetattr");
+      if(ioctl(*ptmp, TIOCSWINSZ, w) < 0)
+        fatal(errno, "error calling ioctl TIOCSWINSZ");
+      cloexec(fd);
+      pool_conn = fd;
+      *pidp = h.pid;
+      free(path);
+      return 1;
+    }
+    /* the broker exists but had nothing to give us */
+    xclose(fd);
+    free(path);
+    return 0;
+  }
+  if(!daemonize()) {
+    if((listenfd = unix_listen(path)) < 0)
+      _exit(0);                         /* someone else beat us to it */
+    cloexec(listenfd);
+    broker(listenfd, path, argv, size, t, w);
+  }
+  free(path);
+  return 0;
+}
+
+/* wait for an adopted child to terminate and return its wait status */
+int pool_wait(void) {
+  int status, err;
+
+  if((err = do_readn(pool_conn, &status, sizeof status)))
+    fatal(err, "error reading wait status from pool broker");
+  xclose(pool_conn);
+  pool_conn = -1;
+  return status;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,280 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Prompt tracking.
+ *
+ * Output from the command is run through a small VT escape sequence parser
+ * whose state persists from one chunk of output to the next.  Printing
+ * characters are accumulated as they are; escape sequences and other
+ * controls are accumulated between RL_PROMPT_START_IGNORE and
+ * RL_PROMPT_END_IGNORE so that Readline knows they take up no space.
+ *
+ * A newline, carriage return or a sequence that moves the cursor to the
+ * first column starts a new line.  Only the last PROMPT_MAX bytes of a line
+ * are kept.
+ *
+ * Commands that know about shell integration mark their prompts with
+ * OSC 133 sequences: A before the prompt and B after it (C and D mark the
+ * start and end of a command's output).  A starts a new line and B means
+ * the prompt is definitely complete.  The marks themselves are not kept.
+ */
+
+#define SEQ_MAX 256                     /* longest sequence we'll keep */
+
+/* parser states; the zero value is the initial state */
+enum {
+  GROUND,                               /* ordinary text */
+  ESCAPE,                               /* after ESC */
+  ESCAPE_INTER,                         /* after ESC and intermediates */
+  CSI,                                  /* after ESC [ */
+  STRING,                               /* in OSC, DCS, etc */
+  STRING_ESC                            /* ESC in a string */
+};
+
+/* forget the current line, and that it was a complete prompt (but not any
+ * partial escape sequence) */
+void prompt_clear(struct prompt *p) {
+  buffer_clear(&p->text);
+  p->width = 0;
+  p->complete = 0;
+}
+
+/* return a copy of the current line, suitable for readline() */
+char *prompt_get(const struct prompt *p) {
+  size_t n = p->text.end - p->text.start;
+  char *s;
+
+  s = xmalloc(n + 1);
+  memcpy(s, p->text.start, n);
+  s[n] = 0;
+  return s;
+}
+
+/* return the number of columns the current line occupies */
+size_t prompt_width(const struct prompt *p) {
+  return p->width;
+}
+
+/* true if the command has ever marked a prompt */
+int prompt_marked(const struct prompt *p) {
+  return p->marked;
+}
+
+/* true if the command has marked the end of the current line's prompt */
+int prompt_complete(const struct prompt *p) {
+  return p->complete;
+}
+
+/* count the visible characters in s[0..n) */
+static size_t visible(const char *s, size_t n) {
+  size_t w = 0;
+  int hidden = 0;
+
+  while(n--) {
+    switch(*s) {
+    case RL_PROMPT_START_IGNORE: hidden = 1; break;
+    case RL_PROMPT_END_IGNORE: hidden = 0; break;
+    default:
+      /* count UTF-8 lead bytes and ASCII, not continuation bytes */
+      if(!hidden && (*s & 0xC0) != 0x80) ++w;
+      break;
+    }
+    ++s;
+  }
+  return w;
+}
+
+/* keep the line down to PROMPT_MAX bytes without splitting an invisible
+ * section */
+static void trim(struct prompt *p) {
+  char *s, *end, *open, *close;
+
+  if(p->text.end - p->text.start <= PROMPT_MAX)
+    return;
+  s = p->text.end - PROMPT_MAX;
+  end = p->text.end;
+  /* if we're inside an invisible section, skip to its end */
+  open = memchr(s, RL_PROMPT_START_IGNORE, end - s);
+  close = memchr(s, RL_PROMPT_END_IGNORE, end - s);
+  if(close && (!open || close < open))
+    s = close + 1;
+  /* don't start half way through a UTF-8 sequence */
+  while(s < end && (*s & 0xC0) == 0x80)
+    ++s;
+  /* move what's kept down, so the buffer never grows past PROMPT_MAX */
+  memmove(p->text.base, s, end - s);
+  p->text.start = p->text.base;
+  p->text.end = p->text.base + (end - s);
+  p->width = visible(p->text.start, end - s);
+}
+
+/* append a completed escape sequence (or control character) to the line as
+ * an invisible section */
+static void hide(struct prompt *p, const char *s, size_t n) {
+  static const char start = RL_PROMPT_START_IGNORE;
+  static const char end = RL_PROMPT_END_IGNORE;
+
+  buffer_append(&p->text, &start, 1);
+  buffer_append(&p->text, s, n);
+  buffer_append(&p->text, &end, 1);
+}
+
+/* true if CSI sequence s (excluding ESC [) puts the cursor in column 1 */
+static int csi_home(const char *s, size_t n) {
+  const char *col;
+  char final = s[n - 1];
+
+  if(final == 'G')
+    col = s;
+  else if(final == 'H' || final == 'f') {
+    if(!(col = memchr(s, ';', n - 1)))
+      return 1;                         /* no column means column 1 */
+    ++col;
+  } else
+    return 0;
+  return col == s + n - 1 || (col[0] == '1' && col + 1 == s + n - 1);
+}
+
+/* the current escape sequence is complete */
+static void sequence_done(struct prompt *p) {
+  const char *s = p->seq.start;
+  size_t n = p->seq.end - p->seq.start;
+
+  p->state = GROUND;
+  if(n > 2 && s[1] == '[' && csi_home(s + 2, n - 2))
+    prompt_clear(p);
+  else if(n > 6 && !memcmp(s, "\033]133;", 6)) {
+    p->marked = 1;
+    switch(s[6]) {
+    case 'A': prompt_clear(p); break;
+    case 'B': p->complete = 1; break;
+    default: p->complete = 0; break;
+    }
+  } else if(n && n < SEQ_MAX)
+    hide(p, s, n);
+  buffer_clear(&p->seq);
+}
+
+/* accumulate a byte of an escape sequence, if we're still keeping them */
+static void sequence_add(struct prompt *p, char c) {
+  if(p->seq.end - p->seq.start < SEQ_MAX)
+    buffer_append(&p->seq, &c, 1);
+}
+
+/* Feed output from the command into the prompt tracker. */
+void prompt_feed(struct prompt *p, const char *buf, size_t n) {
+  const char *nl, *cr, *end = buf + n, *run;
+  unsigned char c;
+
+  /* Nothing before the last line break matters.  Terminals abandon escape
+   * sequences on a line break too, so the parser starts afresh. */
+  nl = memrchr(buf, '\n', n);
+  cr = memrchr(buf, '\r', n);
+  if((nl = !cr || (nl && nl > cr) ? nl : cr)) {
+    buf = nl + 1;
+    prompt_clear(p);
+    buffer_clear(&p->seq);
+    p->state = GROUND;
+  }
+  while(buf < end) {
+    switch(p->state) {
+    case GROUND:
+      /* copy printing characters in bulk; only the last PROMPT_MAX bytes
+       * of a long run can be kept */
+      for(run = buf; buf < end && (c = *buf) >= 0x20 && c != 0x7F; ++buf)
+        ;
+      if(buf - run > PROMPT_MAX) {
+        run = buf - PROMPT_MAX;
+        while(run < buf && (*run & 0xC0) == 0x80)
+          ++run;
+      }
+      p->width += visible(run, buf - run);
+      buffer_append(&p->text, run, buf - run);
+      if(buf == end)
+        break;
+      c = *buf++;
+      if(c == 0x1B) {
+        buffer_clear(&p->seq);
+        sequence_add(p, c);
+        p->state = ESCAPE;
+      } else if(c == '\t') {
+        buffer_append(&p->text, &c, 1);
+        ++p->width;                     /* at least */
+      } else if(c != 0x07)              /* BEL is just dropped */
+        hide(p, (char *)&c, 1);
+      break;
+    case ESCAPE:
+      c = *buf++;
+      sequence_add(p, c);
+      if(c == '[')
+        p->state = CSI;
+      else if(c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X')
+        p->state = STRING;
+      else if(c >= 0x20 && c <= 0x2F)
+        p->state = ESCAPE_INTER;
+      else
+        sequence_done(p);
+      break;
+    case ESCAPE_INTER:
+      c = *buf++;
+      sequence_add(p, c);
+      if(c < 0x20 || c > 0x2F)
+        sequence_done(p);
+      break;
+    case CSI:
+      c = *buf++;
+      sequence_add(p, c);
+      if(c >= 0x40 && c <= 0x7E)
+        sequence_done(p);
+      break;
+    case STRING:
+      c = *buf++;
+      if(c == 0x07) {
+        sequence_add(p, c);
+        sequence_done(p);
+      } else if(c == 0x1B)
+        p->state = STRING_ESC;
+      else
+        sequence_add(p, c);
+      break;
+    case STRING_ESC:
+      c = *buf++;
+      sequence_add(p, 0x1B);
+      sequence_add(p, c);
+      if(c == '\\')
+        sequence_done(p);
+      else
+        p->state = STRING;
+      break;
+    }
+  }
+  trim(p);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,478 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Incremental history search.
+ *
+ * Readline's own reverse-i-search compares the search string with each
+ * history entry in turn on every keystroke, which gets slow once the
+ * history is large.  Instead we keep an index mapping each trigram (three
+ * consecutive bytes) to the serial numbers (see hist.c) of the entries that
+ * contain it.  An entry containing the search string contains all of its
+ * trigrams, so only the entries on the shortest of their lists need to be
+ * looked at.  The terminating null counts as part of a line, so every pair
+ * of bytes in it starts at least one trigram; a search for a pair walks all
+ * of their lists together.  Single bytes have lists of their own.
+ *
+ * Matches are found lazily, newest first, only as far back as the user has
+ * asked to see.  Adding a character to the search string can only rule
+ * matches out, so the ones found so far are filtered and the search carries
+ * on from where it had got to, rather than starting again.  Each keystroke
+ * keeps its own state, so deleting a character goes straight back to it.
+ *
+ * Readline changes an entry's text in place when it is edited, so the text
+ * is always checked against the entry itself; at worst, an edited entry
+ * that has gained a trigram is missed.
+ *
+ * The index is built the first time a search is done and kept up to date
+ * after that.  Serial numbers are stored in 32 bits to save space; a
+ * session would have to add four billion lines for that to matter.
+ */
+
+#define SEARCH_BUCKETS_MIN 4096
+#define SEARCH_BYTE 0x1000000           /* key for a single byte */
+
+struct postings {
+  struct postings *next;
+  uint32_t trigram;                     /* three bytes, packed */
+  uint32_t *serials;                    /* entries containing it, ascending */
+  size_t n, slots;
+};
+
+/* what we know after each keystroke */
+struct state {
+  long *found;                          /* matches so far, newest first */
+  size_t nfound, slots;
+  long frontier;                        /* entries older than this unseen */
+  long shown;                           /* entry shown, or -1 */
+  int failed;                           /* last move found nothing */
+};
+
+static struct postings **buckets;
+static size_t nbuckets, nlists;
+static int indexed;                     /* set once the index is built */
+
+static char *query, *last_query;        /* search strings */
+static size_t qlen, qslots;
+static struct state *states;            /* states[n] is for query[0..n) */
+
+static uint32_t trigram(const char *s) {
+  return (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8
+    | (unsigned char)s[2];
+}
+
+static struct postings **find_list(uint32_t t) {
+  struct postings **pp;
+
+  for(pp = &buckets[t * 2654435761u % nbuckets]; *pp && (*pp)->trigram != t;
+      pp = &(*pp)->next)
+    ;
+  return pp;
+}
+
+static void grow_table(void) {
+  struct postings **old = buckets, *p, *next;
+  size_t oldn = nbuckets, i;
+
+  nbuckets = nbuckets ? 2 * nbuckets : SEARCH_BUCKETS_MIN;
+  buckets = xmalloc(nbuckets * sizeof *buckets);
+  memset(buckets, 0, nbuckets * sizeof *buckets);
+  for(i = 0; i < oldn; ++i)
+    for(p = old[i]; p; p = next) {
+      next = p->next;
+      p->next = buckets[p->trigram * 2654435761u % nbuckets];
+      buckets[p->trigram * 2654435761u % nbuckets] = p;
+    }
+  free(old);
+}
+
+/* add serial to the list for key t */
+static void index_key(uint32_t t, long serial) {
+  struct postings **pp, *p;
+
+  if(!(p = *(pp = find_list(t)))) {
+    if(nlists >= nbuckets) {
+      grow_table();
+      pp = find_list(t);
+    }
+    p = xmalloc(sizeof *p);
+    p->next = 0;
+    p->trigram = t;
+    p->serials = 0;
+    p->n = p->slots = 0;
+    *pp = p;
+    ++nlists;
+  }
+  /* something that appears twice in a line is listed once */
+  if(p->n && p->serials[p->n - 1] == (uint32_t)serial)
+    return;
+  if(p->n == p->slots) {
+    p->slots = p->slots ? 2 * p->slots : 4;
+    p->serials = xrealloc(p->serials, p->slots * sizeof *p->serials);
+  }
+  p->serials[p->n++] = serial;
+}
+
+/* add line, with serial number serial, to the index */
+static void index_line(const char *line, long serial) {
+  for(; *line; ++line) {
+    index_key(SEARCH_BYTE | (unsigned char)*line, serial);
+    if(line[1])
+      index_key(trigram(line), serial);
+  }
+}
+
+/* return the index of the first of v[0..n) that is at least x */
+static size_t lower_bound(const uint32_t *v, size_t n, long x) {
+  size_t lo = 0, hi = n, mid;
+
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if((long)v[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Note that line has been added to the history with serial number
+ * serial. */
+void search_add(const char *line, long serial) {
+  if(indexed)
+    index_line(line, serial);
+}
+
+/* Note that entries older than serial have been removed from the
+ * history. */
+void search_forget(long serial) {
+  struct postings **pp, *p;
+  size_t b, n;
+
+  if(!indexed)
+    return;
+  for(b = 0; b < nbuckets; ++b)
+    for(pp = &buckets[b]; (p = *pp);) {
+      if((n = lower_bound(p->serials, p->n, serial))) {
+        memmove(p->serials, p->serials + n,
+                (p->n - n) * sizeof *p->serials);
+        p->n -= n;
+      }
+      if(!p->n) {
+        *pp = p->next;
+        free(p->serials);
+        free(p);
+        --nlists;
+      } else
+        pp = &p->next;
+    }
+}
+
+/* the index of one history list, while another is in use */
+struct search_state {
+  struct postings **buckets;
+  size_t nbuckets, nlists;
+  int indexed;
+};
+
+/* Set aside the index of the current history list.  The next one is built
+ * when it's first needed. */
+struct search_state *search_save(void) {
+  struct search_state *ss = xmalloc(sizeof *ss);
+
+  ss->buckets = buckets;
+  ss->nbuckets = nbuckets;
+  ss->nlists = nlists;
+  ss->indexed = indexed;
+  buckets = 0;
+  nbuckets = nlists = 0;
+  indexed = 0;
+  return ss;
+}
+
+/* Go back to an index set aside by search_save(), discarding the current
+ * one. */
+void search_restore(struct search_state *ss) {
+  search_discard(search_save());
+  buckets = ss->buckets;
+  nbuckets = ss->nbuckets;
+  nlists = ss->nlists;
+  indexed = ss->indexed;
+  free(ss);
+}
+
+/* Free an index set aside by search_save(). */
+void search_discard(struct search_state *ss) {
+  struct postings *p;
+  size_t b;
+
+  for(b = 0; b < ss->nbuckets; ++b)
+    while((p = ss->buckets[b])) {
+      ss->buckets[b] = p->next;
+      free(p->serials);
+      free(p);
+    }
+  free(ss->buckets);
+  free(ss);
+}
+
+static void push(struct state *st, long serial) {
+  if(st->nfound == st->slots) {
+    st->slots = st->slots ? 2 * st->slots : 16;
+    st->found = xrealloc(st->found, st->slots * sizeof *st->found);
+  }
+  st->found[st->nfound++] = serial;
+}
+
+/* return the text of the entry with serial number serial, or a null
+ * pointer if it has gone */
+static const char *entry(long serial) {
+  long pos = hist_position(serial);
+
+  return pos >= 0 ? history_list()[pos]->line : 0;
+}
+
+/* find the next match older than any found so far; returns 1 if there was
+ * one */
+static int extend(struct state *st) {
+  struct postings *lists[256], *p;
+  const char *line;
+  size_t i, n, nl = 0;
+  long next;
+
+  if(qlen == 1) {
+    if((p = *find_list(SEARCH_BYTE | (unsigned char)query[0])))
+      lists[nl++] = p;
+  } else if(qlen == 2) {
+    for(i = 0; i < 256; ++i)
+      if((p = *find_list((unsigned char)query[0] << 16
+                         | (unsigned char)query[1] << 8 | i)))
+        lists[nl++] = p;
+  } else {
+    /* just the shortest list of any trigram in the search string */
+    for(i = 0; i + 3 <= qlen; ++i) {
+      if(!(p = *find_list(trigram(query + i)))) {
+        nl = 0;                         /* nothing can match */
+        break;
+      }
+      if(!nl || p->n < lists[0]->n) {
+        lists[0] = p;
+        nl = 1;
+      }
+    }
+  }
+  /* walk the lists backwards together from the frontier */
+  for(;;) {
+    next = -1;
+    for(i = 0; i < nl; ++i)
+      if((n = lower_bound(lists[i]->serials, lists[i]->n, st->frontier))
+         && (long)lists[i]->serials[n - 1] > next)
+        next = lists[i]->serials[n - 1];
+    if(next < 0)
+      break;
+    st->frontier = next;
+    if((line = entry(next)) && strstr(line, query)) {
+      push(st, next);
+      return 1;
+    }
+  }
+  st->frontier = 0;
+  return 0;
+}
+
+/* Start a new search. */
+void search_begin(void) {
+  long pos;
+
+  if(!indexed) {
+    if(!nbuckets)
+      grow_table();
+    for(pos = 0; pos < history_length; ++pos)
+      index_line(history_list()[pos]->line, hist_serial(pos));
+    indexed = 1;
+  }
+  if(!qslots) {
+    qslots = 64;
+    query = xmalloc(qslots + 1);
+    states = xmalloc((qslots + 1) * sizeof *states);
+    memset(states, 0, (qslots + 1) * sizeof *states);
+  }
+  qlen = 0;
+  query[0] = 0;
+  states[0].nfound = 0;
+  states[0].frontier = history_length ? hist_serial(history_length - 1) + 1 : 0;
+  states[0].shown = -1;
+  states[0].failed = 0;
+}
+
+/* Show the next match in direction (-1 for older, 1 for newer) from the
+ * one currently shown; inclusive means the current one will do.  Returns
+ * the serial number of the entry now shown, or -1. */
+static long move(int direction, int inclusive) {
+  struct state *st = &states[qlen];
+  size_t i;
+
+  st->failed = 0;
+  if(direction < 0) {
+    for(i = 0; i < st->nfound; ++i)
+      if(st->shown < 0 || st->found[i] < st->shown
+         || (inclusive && st->found[i] == st->shown))
+        break;
+    if(i < st->nfound || extend(st))
+      return st->shown = st->found[i];
+  } else if(st->shown >= 0) {
+    for(i = st->nfound; i-- > 0;)
+      if(st->found[i] > st->shown
+         || (inclusive && st->found[i] == st->shown))
+        return st->shown = st->found[i];
+  }
+  st->failed = 1;
+  return -1;
+}
+
+/* Add c to the search string and look for a match in direction.  Returns
+ * the serial number of the entry shown or -1. */
+long search_narrow(int c, int direction) {
+  struct state *prev, *st;
+  const char *line;
+  size_t i;
+
+  if(qlen == qslots) {
+    qslots *= 2;
+    query = xrealloc(query, qslots + 1);
+    states = xrealloc(states, (qslots + 1) * sizeof *states);
+    memset(states + qlen + 1, 0, (qslots - qlen) * sizeof *states);
+  }
+  query[qlen++] = c;
+  query[qlen] = 0;
+  prev = &states[qlen - 1];
+  st = &states[qlen];
+  st->nfound = 0;
+  for(i = 0; i < prev->nfound; ++i)
+    if((line = entry(prev->found[i])) && strstr(line, query))
+      push(st, prev->found[i]);
+  st->frontier = prev->frontier;
+  st->shown = prev->shown;
+  return move(direction, 1);
+}
+
+/* Remove the last character from the search string.  Returns the serial
+ * number of the entry shown or -1. */
+long search_widen(void) {
+  if(qlen)
+    query[--qlen] = 0;
+  return states[qlen].failed ? -1 : states[qlen].shown;
+}
+
+/* Move to the next match in direction.  Returns the serial number of the
+ * entry shown or -1. */
+long search_next(int direction) {
+  return move(direction, 0);
+}
+
+/* update the display */
+static void show(int direction, const char *original, int point) {
+  const struct state *st = &states[qlen];
+  const char *line;
+
+  if(st->shown >= 0 && (line = entry(st->shown))) {
+    rl_replace_line(line, 0);
+    rl_point = *query ? strstr(line, query) - line : 0;
+  } else {
+    rl_replace_line(original, 0);
+    rl_point = point;
+  }
+  rl_message("(%s%s)`%s': ", st->failed ? "failing " : "",
+             direction < 0 ? "reverse-i-search" : "i-search", query);
+}
+
+/* the replacement for Readline's reverse-search-history and
+ * forward-search-history */
+static int isearch(int attribute((unused)) count, int key) {
+  int direction = key == CTRL('S') ? 1 : -1, c, point = rl_point;
+  char *original = rl_copy_text(0, rl_end);
+  const char *s;
+  long pos;
+
+  rl_maybe_save_line();
+  rl_save_prompt();
+  search_begin();
+  for(;;) {
+    show(direction, original, point);
+    c = rl_read_key();
+    if(c == CTRL('R') || c == CTRL('S')) {
+      direction = c == CTRL('S') ? 1 : -1;
+      if(!qlen && last_query) {
+        /* an empty search repeats the last one */
+        for(s = last_query; *s; ++s)
+          search_narrow((unsigned char)*s, direction);
+      } else if(qlen && search_next(direction) < 0)
+        rl_ding();
+    } else if(c == RUBOUT || c == CTRL('H')) {
+      if(qlen)
+        search_widen();
+      else
+        rl_ding();
+    } else if(c == CTRL('G')) {
+      /* abandon the search */
+      rl_replace_line(original, 0);
+      rl_point = point;
+      break;
+    } else if(c >= ' ') {
+      if(search_narrow(c, direction) < 0)
+        rl_ding();
+    } else {
+      /* anything else ends the search and then does whatever it does; Escape
+       * just ends it */
+      if(states[qlen].shown >= 0
+         && (pos = hist_position(states[qlen].shown)) >= 0)
+        history_set_pos(pos);
+      if(c != ESC && c != EOF)
+        rl_execute_next(c);
+      break;
+    }
+  }
+  if(qlen) {
+    free(last_query);
+    last_query = xstrdup(query);
+  }
+  free(original);
+  rl_restore_prompt();
+  rl_clear_message();
+  return 0;
+}
+
+/* Bind the search keys, unless the user's inputrc says otherwise. */
+void search_bind(void) {
+  rl_add_defun("indexed-reverse-search-history", isearch, CTRL('R'));
+  rl_add_defun("indexed-forward-search-history", isearch, CTRL('S'));
+  rl_bind_key_in_map(CTRL('R'), isearch, vi_insertion_keymap);
+  rl_bind_key_in_map(CTRL('S'), isearch, vi_insertion_keymap);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,201 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+/* Shared history.
+ *
+ * We remember how much of the history file we've seen and, when it grows,
+ * read just the new part and add the complete lines in it to the history.
+ * Every writer appends whole records with a single O_APPEND write, so we
+ * never see half of someone else's line.
+ *
+ * Our own lines turn up in the file too (later, if the history writer is
+ * batching them).  We keep a queue of lines we've written and skip them as
+ * they appear.  They appear in the order they were written, so any before
+ * the one that turns up must have been lost (e.g. to a write error) and
+ * are dropped from the queue.
+ *
+ * Where inotify is available we watch the file's directory, so we notice
+ * the file being replaced as well as appended to.  Otherwise the file is
+ * checked before each prompt.
+ */
+
+struct sent {
+  struct sent *next;
+  char *line;
+};
+
+static char *share_path;                /* history file */
+static const char *share_name;          /* its name within its directory */
+static int watch_fd = -1;               /* inotify fd */
+static off_t seen;                      /* bytes of the file we've seen */
+static dev_t seen_dev;                  /* identity of the file */
+static ino_t seen_ino;
+static struct sent *sent, **sent_tail = &sent;
+
+/* Start sharing history via path, which has just been read. */
+void share_start(const char *path) {
+  struct stat sb;
+#if HAVE_SYS_INOTIFY_H
+  char *dir;
+#endif
+
+  share_path = xstrdup(path);
+  share_name = strrchr(share_path, '/') + 1;
+  if(stat(path, &sb) == 0) {
+    seen = sb.st_size;
+    seen_dev = sb.st_dev;
+    seen_ino = sb.st_ino;
+  }
+#if HAVE_SYS_INOTIFY_H
+  if((watch_fd = inotify_init()) >= 0) {
+    cloexec(watch_fd);
+    dir = xstrdup(share_path);
+    dir[share_name - 1 - share_path] = 0;
+    if(inotify_add_watch(watch_fd, *dir ? dir : "/",
+                         IN_MODIFY|IN_CREATE|IN_MOVED_TO) < 0) {
+      close(watch_fd);
+      watch_fd = -1;
+    }
+    free(dir);
+  }
+#endif
+}
+
+/* return the fd to watch for changes, or -1 */
+int share_watch(void) {
+  return watch_fd;
+}
+
+/* note that we've written line to the history file */
+void share_sent(const char *line) {
+  struct sent *s;
+
+  if(!share_path)
+    return;
+  s = xmalloc(sizeof *s);
+  s->line = xstrdup(line);
+  s->next = 0;
+  *sent_tail = s;
+  sent_tail = &s->next;
+}
+
+/* add one line from the file to the history, unless it's ours */
+static void share_line(const char *line) {
+  struct sent *s, *found;
+
+  if(!*line || (line[0] == '#' && line[1] >= '0' && line[1] <= '9'))
+    return;                             /* blank or a timestamp */
+  for(found = sent; found && strcmp(found->line, line); found = found->next)
+    ;
+  if(!found) {
+    hist_add(line);
+    return;
+  }
+  /* drop it and anything before it */
+  while((s = sent) != found) {
+    sent = s->next;
+    free(s->line);
+    free(s);
+  }
+  if(!(sent = found->next))
+    sent_tail = &sent;
+  free(found->line);
+  free(found);
+}
+
+/* pick up anything new in the history file */
+void share_poll(void) {
+  struct stat sb;
+  struct buffer text;
+  char *buf, *s, *nl;
+  size_t n = 0;
+  ssize_t r;
+  int fd;
+
+  if(!share_path || (fd = open(share_path, O_RDONLY)) < 0)
+    return;
+  if(fstat(fd, &sb) < 0) {
+    close(fd);
+    return;
+  }
+  if(sb.st_dev != seen_dev || sb.st_ino != seen_ino
+     || sb.st_size < seen) {
+    /* the file has been replaced or truncated, presumably with a compacted
+     * version of what was there before; start again from its end */
+    seen_dev = sb.st_dev;
+    seen_ino = sb.st_ino;
+    seen = sb.st_size;
+  } else if(sb.st_size > seen) {
+    buf = xmalloc(sb.st_size - seen + 1);
+    while(n < (size_t)(sb.st_size - seen)) {
+      r = pread(fd, buf + n, sb.st_size - seen - n, seen + n);
+      if(r < 0 && errno == EINTR) continue;
+      if(r <= 0) break;
+      n += r;
+    }
+    /* only complete lines (and members, if it's compressed); the rest will
+     * be finished later */
+    buffer_init(&text);
+    seen += history_decode_text(buf, n, &text);
+    buffer_append(&text, "", 1);
+    for(s = text.start; (nl = memchr(s, '\n', text.end - s)); s = nl + 1) {
+      *nl = 0;
+      share_line(s);
+    }
+    free(text.base);
+    free(buf);
+  }
+  close(fd);
+}
+
+/* the watched directory has changed */
+void share_event(void) {
+#if HAVE_SYS_INOTIFY_H
+  char buf[4096] attribute((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+  int ours = 0;
+
+  if((n = read(watch_fd, buf, sizeof buf)) <= 0)
+    return;
+  for(p = buf; p < buf + n; p += sizeof *ev + ev->len) {
+    ev = (const struct inotify_event *)p;
+    if(ev->len && !strcmp(ev->name, share_name))
+      ours = 1;
+  }
+  if(ours)
+    share_poll();
+#endif
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,193 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Learned prompt signatures.
+ *
+ * A signature is the visible text of a prompt with every digit replaced by
+ * '#', so that "In [12]: " and "In [13]: " are the same prompt.  Each
+ * application has a small set of them, most recently used first, in a file
+ * next to its history file:
+ *
+ *   COUNT SIGNATURE
+ *
+ * COUNT is the number of times the prompt has been seen.  A prompt has to be
+ * seen SIG_CONFIRM times before it is trusted, so that the odd partial line
+ * mistaken for a prompt doesn't cause trouble.
+ */
+
+#define SIG_MAX 32                      /* signatures kept per application */
+#define SIG_CONFIRM 2                   /* sightings before we trust one */
+
+static struct sig {
+  char *text;                           /* the signature */
+  size_t width;                         /* its visible width */
+  long count;                           /* times seen */
+} sigs[SIG_MAX];
+static int nsigs;
+
+static char *sigfile;                   /* where they live */
+static int sigs_changed;                /* set if sigfile needs rewriting */
+
+/* compute the signature of a prompt.  The width is the same as
+ * prompt_width() would give. */
+static char *signature(const struct prompt *p, size_t *widthp) {
+  char *s = prompt_get(p), *t, *u;
+  int hidden = 0;
+  size_t w = 0;
+
+  for(t = u = s; *t; ++t) {
+    switch(*t) {
+    case RL_PROMPT_START_IGNORE: hidden = 1; break;
+    case RL_PROMPT_END_IGNORE: hidden = 0; break;
+    default:
+      if(hidden) break;
+      if((*t & 0xC0) != 0x80) ++w;
+      *u++ = (*t >= '0' && *t <= '9') ? '#' : *t;
+      break;
+    }
+  }
+  *u = 0;
+  *widthp = w;
+  return s;
+}
+
+/* return the signature of the current line */
+char *sigs_signature(const struct prompt *p) {
+  size_t width;
+
+  return signature(p, &width);
+}
+
+/* visible width of a signature read from the file */
+static size_t sigwidth(const char *s) {
+  size_t w = 0;
+
+  for(; *s; ++s)
+    if((*s & 0xC0) != 0x80) ++w;
+  return w;
+}
+
+/* read the signatures for an application.  A missing or unreadable file
+ * just means we haven't learned anything yet. */
+void sigs_load(const char *path) {
+  FILE *fp;
+  char *l = 0, *text;
+  size_t n = 0;
+  ssize_t len;
+  long count;
+
+  sigfile = xstrdup(path);
+  if(!(fp = fopen(path, "r")))
+    return;
+  while(nsigs < SIG_MAX && (len = getline(&l, &n, fp)) >= 0) {
+    if(len && l[len - 1] == '\n') l[--len] = 0;
+    count = strtol(l, &text, 10);
+    if(count <= 0 || *text++ != ' ' || !*text)
+      continue;
+    sigs[nsigs].text = xstrdup(text);
+    sigs[nsigs].width = sigwidth(text);
+    sigs[nsigs++].count = count;
+  }
+  free(l);
+  fclose(fp);
+}
+
+/* write the signatures back, if they've changed.  Errors are ignored; at
+ * worst we have to learn the prompts again. */
+void sigs_save(void) {
+  char *tmp;
+  FILE *fp;
+  int n, bad = 0;
+
+  if(!sigs_changed)
+    return;
+  tmp = xmalloc(strlen(sigfile) + 32);
+  sprintf(tmp, "%s.%lu", sigfile, (unsigned long)getpid());
+  if(!(fp = fopen(tmp, "w"))) {
+    free(tmp);
+    return;
+  }
+  for(n = 0; n < nsigs; ++n)
+    if(fprintf(fp, "%ld %s\n", sigs[n].count, sigs[n].text) < 0)
+      bad = 1;
+  if(fclose(fp) < 0 || bad || rename(tmp, sigfile) < 0)
+    unlink(tmp);
+  free(tmp);
+  sigs_changed = 0;
+}
+
+/* true if the current line is a prompt we know */
+int sigs_match(const struct prompt *p) {
+  size_t width = prompt_width(p), w;
+  char *s = 0;
+  int n, found = 0;
+
+  /* comparing widths is cheap and usually rules everything out */
+  for(n = 0; n < nsigs && !found; ++n) {
+    if(sigs[n].count < SIG_CONFIRM || sigs[n].width != width)
+      continue;
+    if(!s)
+      s = signature(p, &w);
+    found = !strcmp(s, sigs[n].text);
+  }
+  free(s);
+  return found;
+}
+
+/* note that the current line has been used as a prompt */
+void sigs_learn(const struct prompt *p) {
+  struct sig sig;
+  size_t width;
+  char *s;
+  int n;
+
+  if(!sigfile || !prompt_width(p))
+    return;
+  s = signature(p, &width);
+  for(n = 0; n < nsigs && strcmp(s, sigs[n].text); ++n)
+    ;
+  if(n < nsigs) {
+    free(s);
+    sig = sigs[n];
+  } else {
+    if(nsigs == SIG_MAX)
+      free(sigs[--nsigs].text);         /* forget the least recent */
+    sig.text = s;
+    sig.width = width;
+    sig.count = 0;
+    n = nsigs++;
+  }
+  ++sig.count;
+  /* most recent first */
+  memmove(sigs + 1, sigs, n * sizeof *sigs);
+  sigs[0] = sig;
+  sigs_changed = 1;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
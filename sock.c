@@ -0,0 +1,271 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* return the per-user directory for sockets, creating it if necessary */
+const char *rundir(void) {
+  static char *dir;
+  const char *base;
+  struct stat sb;
+
+  if(dir) return dir;
+  if((base = getenv("XDG_RUNTIME_DIR")) && *base) {
+    dir = xmalloc(strlen(base) + 32);
+    sprintf(dir, "%s/with-readline", base);
+  } else {
+    dir = xmalloc(64);
+    sprintf(dir, "/tmp/with-readline-%lu", (unsigned long)getuid());
+  }
+  if(mkdir(dir, 0700) < 0 && errno != EEXIST)
+    fatal(errno, "error creating %s", dir);
+  /* anyone could have created it in /tmp, so check it's really ours */
+  if(lstat(dir, &sb) < 0)
+    fatal(errno, "error calling lstat on %s", dir);
+  if(!S_ISDIR(sb.st_mode) || sb.st_uid != getuid() || (sb.st_mode & 077))
+    fatal(0, "%s has unsuitable type, owner or mode", dir);
+  return dir;
+}
+
+static int unix_address(struct sockaddr_un *sun, const char *path) {
+  memset(sun, 0, sizeof *sun);
+  sun->sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof sun->sun_path)
+    return ENAMETOOLONG;
+  strcpy(sun->sun_path, path);
+  return 0;
+}
+
+/* connect to a Unix socket.  Returns the fd or -1 and sets errno. */
+int unix_connect(const char *path) {
+  struct sockaddr_un sun;
+  int fd, err;
+
+  if((err = unix_address(&sun, path))) {
+    errno = err;
+    return -1;
+  }
+  if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+    fatal(errno, "error calling socket");
+  if(connect(fd, (struct sockaddr *)&sun, sizeof sun) < 0) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+/* listen on a Unix socket.  Returns the fd or -1 and sets errno.  A stale
+ * socket (nobody listening) is replaced; a live one gets EADDRINUSE. */
+int unix_listen(const char *path) {
+  struct sockaddr_un sun;
+  int fd, other, err;
+
+  if((err = unix_address(&sun, path))) {
+    errno = err;
+    return -1;
+  }
+  if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+    fatal(errno, "error calling socket");
+  if(bind(fd, (struct sockaddr *)&sun, sizeof sun) < 0) {
+    err = errno;
+    if(err == EADDRINUSE) {
+      if((other = unix_connect(path)) >= 0)
+        close(other);
+      else if(errno == ECONNREFUSED) {
+        unlink(path);
+        if(bind(fd, (struct sockaddr *)&sun, sizeof sun) < 0)
+          err = errno;
+        else
+          err = 0;
+      }
+    }
+    if(err) {
+      close(fd);
+      errno = err;
+      return -1;
+    }
+  }
+  if(listen(fd, 16) < 0)
+    fatal(errno, "error calling listen");
+  return fd;
+}
+
+/* send n bytes from buf, without raising SIGPIPE if the other end has
+ * gone.  Returns 0 or an errno value. */
+int send_all(int sock, const void *buf, size_t n) {
+  const char *p = buf;
+  ssize_t r;
+
+  while(n) {
+    if((r = send(sock, p, n, MSG_NOSIGNAL)) < 0) {
+      if(errno != EINTR)
+        return errno;
+    } else {
+      p += r;
+      n -= r;
+    }
+  }
+  return 0;
+}
+
+/* send n bytes from buf, with fd attached.  Returns 0 or an errno value. */
+int send_fd(int sock, int fd, const void *buf, size_t n) {
+  struct msghdr m;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  union {
+    struct cmsghdr cm;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  memset(&m, 0, sizeof m);
+  memset(&control, 0, sizeof control);
+  iov.iov_base = (void *)buf;
+  iov.iov_len = n;
+  m.msg_iov = &iov;
+  m.msg_iovlen = 1;
+  m.msg_control = control.space;
+  m.msg_controllen = sizeof control.space;
+  cm = CMSG_FIRSTHDR(&m);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &fd, sizeof fd);
+  while(sendmsg(sock, &m, 0) < 0)
+    if(errno != EINTR) return errno;
+  return 0;
+}
+
+/* receive exactly n bytes into buf, and an fd if one was attached (else
+ * *fdp is set to -1).  Returns 0 or an errno value; EOF is reported as
+ * EPIPE. */
+int recv_fd(int sock, int *fdp, void *buf, size_t n) {
+  struct msghdr m;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  union {
+    struct cmsghdr cm;
+    char space[CMSG_SPACE(sizeof(int))];
+  } control;
+  ssize_t r;
+  size_t got = 0;
+
+  *fdp = -1;
+  while(got < n) {
+    memset(&m, 0, sizeof m);
+    iov.iov_base = (char *)buf + got;
+    iov.iov_len = n - got;
+    m.msg_iov = &iov;
+    m.msg_iovlen = 1;
+    m.msg_control = control.space;
+    m.msg_controllen = sizeof control.space;
+    if((r = recvmsg(sock, &m, 0)) < 0) {
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    if(!r) return EPIPE;
+    for(cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm))
+      if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(fdp, CMSG_DATA(cm), sizeof *fdp);
+    got += r;
+  }
+  return 0;
+}
+
+/* mark fd close-on-exec */
+void cloexec(int fd) {
+  int flags;
+
+  if((flags = fcntl(fd, F_GETFD)) < 0)
+    fatal(errno, "error calling fcntl F_GETFD");
+  if(fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
+    fatal(errno, "error calling fcntl F_SETFD");
+}
+
+/* make fd non-blocking */
+void nonblock(int fd) {
+  int flags;
+
+  if((flags = fcntl(fd, F_GETFL)) < 0)
+    fatal(errno, "error calling fcntl F_GETFL");
+  if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    fatal(errno, "error calling fcntl F_SETFL");
+}
+
+/* detach from the caller: fork, start a new session, close everything and
+ * point the standard fds at /dev/null.  Returns in the daemon (0) and in the
+ * caller (1). */
+int daemonize(void) {
+  pid_t pid;
+  int n, fd;
+
+  switch(pid = fork()) {
+  case -1:
+    fatal(errno, "error calling fork");
+  default:
+    while(waitpid(pid, &n, 0) < 0 && errno == EINTR)
+      ;
+    return 1;
+  case 0:
+    break;
+  }
+  exitfn = _exit;
+  if(setsid() < 0)
+    fatal(errno, "error calling setsid");
+  switch(fork()) {
+  case -1:
+    fatal(errno, "error calling fork");
+  default:
+    _exit(0);
+  case 0:
+    break;
+  }
+  /* don't hang on to anything the caller had open */
+  for(fd = getdtablesize() - 1; fd > 2; --fd)
+    close(fd);
+  if((fd = open("/dev/null", O_RDWR, 0)) < 0)
+    fatal(errno, "error opening /dev/null");
+  for(n = 0; n < 3; ++n)
+    if(fd != n && dup2(fd, n) < 0)
+      fatal(errno, "error calling dup2");
+  if(fd > 2) xclose(fd);
+  signal(SIGPIPE, SIG_IGN);
+  return 0;
+}
+
+/* hash a string into h (FNV-1a) */
+uint64_t hash_string(uint64_t h, const char *s, size_t n) {
+  while(n--) {
+    h ^= (unsigned char)*s++;
+    h *= UINT64_C(0x100000001b3);
+  }
+  return h;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,383 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* Autosuggestions.
+ *
+ * The distinct history lines are kept in a radix tree: each node is labelled
+ * with the bytes that lead to it from its parent, and only has a single
+ * child if it ends a line.  Every node points at the best line below it, so
+ * finding the best completion of what has been typed so far costs one walk
+ * down the tree, however big the history is.
+ *
+ * A line's rank is the serial number (see hist.c) of its latest use plus
+ * SUGGEST_WEIGHT for every earlier one.  Adding a line doesn't change the
+ * rank of any other line, so only the nodes above it need looking at, and
+ * then only until one is found whose best line is better.
+ *
+ * The lines are also kept in order of latest use, so they can be dropped
+ * when they fall out of the history.
+ */
+
+#define SUGGEST_WEIGHT 100              /* one use is worth this many lines */
+
+struct node {
+  struct node *parent, *child, *sibling;
+  struct node *best;                    /* best line in this subtree */
+  struct node *older, *newer;           /* lines in order of latest use */
+  long latest;                          /* serial number of latest use */
+  long rank;                            /* ...adjusted for popularity */
+  unsigned count;                       /* uses, or 0 if not a line */
+  size_t len;                           /* length of label */
+  char label[];                         /* bytes from parent to here */
+};
+
+static struct node *root;               /* lines from the current history */
+static struct node *oldest, *newest;
+static int enabled;                     /* set if suggestions are wanted */
+static int drawn;                       /* a suggestion is on the screen */
+
+static struct node *new_node(struct node *parent, const char *label,
+                             size_t len) {
+  struct node *n = xmalloc(sizeof *n + len);
+
+  memset(n, 0, sizeof *n);
+  memcpy(n->label, label, len);
+  n->len = len;
+  n->parent = parent;
+  n->sibling = parent->child;
+  parent->child = n;
+  return n;
+}
+
+/* remove n from its parent's children */
+static void unlink_node(struct node *n) {
+  struct node **np;
+
+  for(np = &n->parent->child; *np != n; np = &(*np)->sibling)
+    ;
+  *np = n->sibling;
+}
+
+/* return the node for s, creating it if necessary */
+static struct node *insert(const char *s) {
+  struct node *n = root, *c, *mid;
+  size_t i;
+
+  while(*s) {
+    for(c = n->child; c && c->label[0] != *s; c = c->sibling)
+      ;
+    if(!c)
+      return new_node(n, s, strlen(s));
+    for(i = 1; i < c->len && s[i] == c->label[i]; ++i)
+      ;
+    if(i < c->len) {
+      /* s leaves c's label part way along, so split it.  c keeps its
+       * identity since other nodes may point at it. */
+      mid = new_node(n, c->label, i);
+      unlink_node(c);
+      c->parent = mid;
+      c->sibling = 0;
+      mid->child = c;
+      mid->best = c->best;
+      memmove(c->label, c->label + i, c->len - i);
+      c->len -= i;
+      c = mid;
+    }
+    n = c;
+    s += i;
+  }
+  return n;
+}
+
+/* return the best line among n and its descendants, not counting n's
+ * current best */
+static struct node *recompute(struct node *n) {
+  struct node *b = n->count ? n : 0, *c;
+
+  for(c = n->child; c; c = c->sibling)
+    if(c->best && (!b || c->best->rank > b->rank))
+      b = c->best;
+  return b;
+}
+
+/* drop the line ending at t */
+static void remove_line(struct node *t) {
+  struct node *n, *p;
+
+  *(t->older ? &t->older->newer : &oldest) = t->newer;
+  *(t->newer ? &t->newer->older : &newest) = t->older;
+  t->count = 0;
+  for(n = t; n && n->best == t; n = n->parent)
+    n->best = recompute(n);
+  /* nodes that lead nowhere can go; nodes with one child are left alone */
+  for(n = t; n != root && !n->count && !n->child; n = p) {
+    p = n->parent;
+    unlink_node(n);
+    free(n);
+  }
+}
+
+static struct node *new_root(void) {
+  struct node *n = xmalloc(sizeof *n);
+
+  memset(n, 0, sizeof *n);
+  return n;
+}
+
+/* the suggestions for one history list, while another is in use */
+struct suggest_state {
+  struct node *root, *oldest, *newest;
+};
+
+/* Set aside the suggestions from the current history list, and start with
+ * none. */
+struct suggest_state *suggest_save(void) {
+  struct suggest_state *ss = xmalloc(sizeof *ss);
+
+  ss->root = root;
+  ss->oldest = oldest;
+  ss->newest = newest;
+  root = new_root();
+  oldest = newest = 0;
+  return ss;
+}
+
+/* Go back to suggestions set aside by suggest_save(), discarding the
+ * current ones. */
+void suggest_restore(struct suggest_state *ss) {
+  suggest_discard(suggest_save());
+  root = ss->root;
+  oldest = ss->oldest;
+  newest = ss->newest;
+  free(ss);
+}
+
+static void free_tree(struct node *n) {
+  struct node *c, *next;
+
+  for(c = n->child; c; c = next) {
+    next = c->sibling;
+    free_tree(c);
+  }
+  free(n);
+}
+
+/* Free suggestions set aside by suggest_save(). */
+void suggest_discard(struct suggest_state *ss) {
+  if(ss->root)
+    free_tree(ss->root);
+  free(ss);
+}
+
+/* Note that line has been added to the history with serial number
+ * serial. */
+void suggest_add(const char *line, long serial) {
+  struct node *t, *n;
+
+  if(!enabled || !*line)
+    return;
+  t = insert(line);
+  if(t->count) {
+    *(t->older ? &t->older->newer : &oldest) = t->newer;
+    *(t->newer ? &t->newer->older : &newest) = t->older;
+  }
+  t->latest = serial;
+  t->rank = serial + SUGGEST_WEIGHT * (long)t->count++;
+  t->older = newest;
+  t->newer = 0;
+  *(newest ? &newest->newer : &oldest) = t;
+  newest = t;
+  for(n = t; n && !(n->best && n->best != t && n->best->rank > t->rank);
+      n = n->parent)
+    n->best = t;
+}
+
+/* Note that entries older than serial have been removed from the
+ * history. */
+void suggest_forget(long serial) {
+  while(oldest && oldest->latest < serial)
+    remove_line(oldest);
+}
+
+/* Return the rest of the best line starting with s (and longer than it),
+ * or a null pointer if there isn't one.  The result is overwritten by the
+ * next call. */
+const char *suggest_lookup(const char *s) {
+  static char *text;
+  static size_t size;
+  struct node *n = root, *c, *b;
+  size_t i = 0, len, slen = strlen(s);
+  char *p;
+
+  if(!*s)
+    return 0;
+  while(*s) {
+    for(c = n->child; c && c->label[0] != *s; c = c->sibling)
+      ;
+    if(!c)
+      return 0;
+    for(i = 1; i < c->len && s[i] && s[i] == c->label[i]; ++i)
+      ;
+    if(i < c->len && s[i])
+      return 0;
+    n = c;
+    s += i;
+  }
+  /* if what's typed is itself the best line, look for a longer one */
+  if((b = n->best) == n && i == n->len)
+    for(b = 0, c = n->child; c; c = c->sibling)
+      if(c->best && (!b || c->best->rank > b->rank))
+        b = c->best;
+  if(!b)
+    return 0;
+  for(len = 0, c = b; c; c = c->parent)
+    len += c->len;
+  if(len + 1 > size) {
+    size = len + 64;
+    text = xrealloc(text, size);
+  }
+  p = text + len;
+  *p = 0;
+  for(c = b; c; c = c->parent)
+    memcpy(p -= c->len, c->label, c->len);
+  return text + slen;
+}
+
+/* return the number of columns s takes up, not counting anything between
+ * Readline's ignore markers, or anything before a newline */
+static int columns(const char *s) {
+  int col = 0, ignore = 0;
+
+  for(; *s; ++s) {
+    if(*s == RL_PROMPT_START_IGNORE) ignore = 1;
+    else if(*s == RL_PROMPT_END_IGNORE) ignore = 0;
+    else if(*s == '\n') col = 0;
+    else if(!ignore && (*s & 0xC0) != 0x80) ++col;
+  }
+  return col;
+}
+
+/* redisplay with the suggestion, if there is one, after the cursor */
+static void redisplay(void) {
+  FILE *fp = rl_outstream;
+  const char *rest;
+  int rows, cols, col, w;
+
+  if(drawn) {
+    fputs("\033[K", fp);                /* the cursor is where we left it */
+    drawn = 0;
+  }
+  rl_redisplay();
+  /* not in the middle of the line, or while a search is being displayed */
+  if(rl_point != rl_end || !rl_end || rl_display_prompt != rl_prompt
+     || !(rest = suggest_lookup(rl_line_buffer)))
+    return;
+  rl_get_screen_size(&rows, &cols);
+  col = (columns(rl_display_prompt) + columns(rl_line_buffer)) % cols;
+  /* don't let it wrap, so the cursor can be moved back */
+  fputs("\033[2m", fp);
+  for(w = 0; *rest && (col + w < cols - 1 || (*rest & 0xC0) == 0x80);
+      ++rest) {
+    if((*rest & 0xC0) != 0x80)
+      ++w;
+    fputc((unsigned char)*rest < ' ' || *rest == 127 ? '?' : *rest, fp);
+  }
+  fputs("\033[m", fp);
+  if(w)
+    fprintf(fp, "\033[%dD", w);
+  fflush(fp);
+  drawn = 1;
+}
+
+/* accept the suggestion, or move forward a character if there isn't one */
+static int accept_suggestion(int count, int key) {
+  const char *rest;
+
+  if(rl_point == rl_end && rl_end
+     && (rest = suggest_lookup(rl_line_buffer))) {
+    rl_insert_text(rest);
+    return 0;
+  }
+  return rl_forward_char(count, key);
+}
+
+/* accept the line, first clearing the suggestion; Readline won't redisplay
+ * again, so it would otherwise be left on the screen */
+static int accept_line(int count, int key) {
+  if(drawn) {
+    fputs("\033[K", rl_outstream);
+    fflush(rl_outstream);
+    drawn = 0;
+  }
+  return rl_newline(count, key);
+}
+
+/* Take over the keys bound to accept-line, once Readline has read the
+ * user's bindings. */
+void suggest_bind(void) {
+  Keymap maps[3];
+  char **seqs;
+  int m, n;
+
+  if(!enabled)
+    return;
+  maps[0] = emacs_standard_keymap;
+  maps[1] = vi_insertion_keymap;
+  maps[2] = vi_movement_keymap;
+  for(m = 0; m < 3; ++m)
+    if((seqs = rl_invoking_keyseqs_in_map(rl_newline, maps[m]))) {
+      for(n = 0; seqs[n]; ++n) {
+        rl_bind_keyseq_in_map(seqs[n], accept_line, maps[m]);
+        free(seqs[n]);
+      }
+      free(seqs);
+    }
+}
+
+/* Add the lines already in the history, if suggestions are wanted. */
+void suggest_index(void) {
+  long pos;
+
+  for(pos = 0; pos < history_length; ++pos)
+    suggest_add(history_list()[pos]->line, hist_serial(pos));
+}
+
+/* Start suggesting lines from the history as they're typed. */
+void suggest_start(void) {
+  enabled = 1;
+  if(!root)
+    root = new_root();
+  suggest_index();
+  rl_redisplay_function = redisplay;
+  rl_add_defun("accept-suggestion", accept_suggestion, CTRL('F'));
+  rl_bind_keyseq("\\e[C", accept_suggestion);
+  rl_bind_keyseq("\\eOC", accept_suggestion);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,119 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+#define MAX_MARKS 32
+#define MAX_COUNTS 8
+
+int timing;                             /* set to record timings */
+const char *timing_file;                /* report destination or 0 */
+
+static struct timespec epoch;           /* when timing started */
+
+static struct mark {
+  const char *phase;                    /* what just finished */
+  struct timespec when;                 /* when it finished */
+} marks[MAX_MARKS];
+static int nmarks;
+
+static struct count {
+  const char *what;                     /* what was counted */
+  unsigned long n;                      /* how many */
+} counts[MAX_COUNTS];
+static int ncounts;
+
+/* milliseconds from a to b */
+static double ms(const struct timespec *a, const struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) * 1000.0
+    + (b->tv_nsec - a->tv_nsec) / 1000000.0;
+}
+
+/* get the current monotonic time */
+void monotonic(struct timespec *ts) {
+  if(clock_gettime(CLOCK_MONOTONIC, ts) < 0)
+    fatal(errno, "error calling clock_gettime");
+}
+
+/* milliseconds since ts */
+long ms_since(const struct timespec *ts) {
+  struct timespec now;
+
+  monotonic(&now);
+  return (now.tv_sec - ts->tv_sec) * 1000L
+    + (now.tv_nsec - ts->tv_nsec) / 1000000L;
+}
+
+/* start the clock */
+void timing_start(void) {
+  monotonic(&epoch);
+}
+
+/* record that phase has just finished.  Only the first mark for a given
+ * phase counts, so this can be called freely from the event loop. */
+void timing_mark(const char *phase) {
+  int n;
+
+  if(!timing || nmarks == MAX_MARKS) return;
+  for(n = 0; n < nmarks; ++n)
+    if(!strcmp(marks[n].phase, phase))
+      return;
+  monotonic(&marks[nmarks].when);
+  marks[nmarks++].phase = phase;
+}
+
+/* record a quantity of interest alongside the timings */
+void timing_count(const char *what, unsigned long n) {
+  if(!timing || ncounts == MAX_COUNTS) return;
+  counts[ncounts].what = what;
+  counts[ncounts++].n = n;
+}
+
+/* write the timings to stderr or, if set, timing_file */
+void timing_report(const char *command) {
+  FILE *fp;
+  int n;
+
+  if(!timing) return;
+  if(timing_file) {
+    if(!(fp = fopen(timing_file, "a")))
+      fatal(errno, "error opening %s", timing_file);
+  } else
+    fp = stderr;
+  fprintf(fp, "with-readline startup timing for %s:\n", command);
+  for(n = 0; n < nmarks; ++n)
+    fprintf(fp, "  %-20s %10.3f ms %10.3f ms\n",
+            marks[n].phase,
+            ms(&epoch, &marks[n].when),
+            ms(n ? &marks[n - 1].when : &epoch, &marks[n].when));
+  for(n = 0; n < ncounts; ++n)
+    fprintf(fp, "  %-20s %10lu\n", counts[n].what, counts[n].n);
+  if(fp != stderr && fclose(fp) < 0)
+    fatal(errno, "error writing %s", timing_file);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,175 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+
+/* The session shell for --sigttin.  See "Using SIGTTIN" in design.txt.
+ *
+ * We are the session leader and own the pty as our controlling terminal.
+ * The command runs in its own process group, which is normally in the
+ * background, so when it tries to read it is stopped by SIGTTIN.  We tell
+ * the parent ('R') when that happens.  When the parent has written a line
+ * to the master it tells us ('G'); we make the command's process group the
+ * foreground process group, continue it, and put it back in the background
+ * once it has consumed what's waiting in the input queue.
+ */
+
+#define DRAIN_FAST 100                  /* 1ms polls before slowing down */
+
+static pid_t child;                     /* the command */
+static int chldpipe[2];                 /* SIGCHLD notifications */
+
+/* we're the foreground process group (most of the time) so the terminal's
+ * signals come to us.  Pass them on, and make sure a stopped command gets to
+ * see them. */
+static void forward(int sig) {
+  int save = errno;
+
+  kill(-child, sig);
+  if(sig != SIGWINCH)
+    kill(-child, SIGCONT);
+  errno = save;
+}
+
+static void chldhandler(int attribute((unused)) sig) {
+  int save = errno;
+
+  write(chldpipe[1], "", 1);
+  errno = save;
+}
+
+/* terminate the same way as the command did */
+static void attribute((noreturn)) mimic(int status) {
+  if(WIFSIGNALED(status)) {
+    signal(WTERMSIG(status), SIG_DFL);
+    kill(getpid(), WTERMSIG(status));
+  }
+  _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 255);
+}
+
+static void background(void) {
+  if(tcsetpgrp(0, getpgrp()) < 0)
+    fatal(errno, "error calling tcsetpgrp");
+}
+
+/* Run argv under our supervision, communicating with the parent over ctl.
+ * Never returns. */
+void ttin_shell(int ctl, char **argv) {
+  static const int forwarded[] = { SIGINT, SIGQUIT, SIGHUP, SIGWINCH, 0 };
+  struct sigaction sa;
+  struct timeval tv;
+  fd_set fds;
+  int n, status, queued, draining = 0, seen = 0, polls = 0;
+  char c;
+  pid_t r;
+
+  /* we have to be able to call tcsetpgrp() from the background */
+  signal(SIGTTOU, SIG_IGN);
+  if(pipe(chldpipe) < 0) fatal(errno, "error creating pipe");
+  switch(child = fork()) {
+  case -1:
+    fatal(errno, "error calling fork");
+  case 0:
+    if(setpgid(0, 0) < 0)
+      fatal(errno, "error calling setpgid");
+    xclose(ctl);
+    xclose(chldpipe[0]);
+    xclose(chldpipe[1]);
+    /* SIGTTOU stays ignored so that the command can write, and change
+     * terminal settings, from the background */
+    execvp(argv[0], argv);
+    fatal(errno, "error executing %s", argv[0]);
+  }
+  /* whichever of us gets there first */
+  if(setpgid(child, child) < 0 && errno != EACCES)
+    fatal(errno, "error calling setpgid");
+  sa.sa_handler = chldhandler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if(sigaction(SIGCHLD, &sa, 0) < 0)
+    fatal(errno, "error installing signal handler");
+  sa.sa_handler = forward;
+  for(n = 0; forwarded[n]; ++n)
+    if(sigaction(forwarded[n], &sa, 0) < 0)
+      fatal(errno, "error installing signal handler");
+  background();
+  for(;;) {
+    FD_ZERO(&fds);
+    FD_SET(ctl, &fds);
+    FD_SET(chldpipe[0], &fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = polls < DRAIN_FAST ? 1000 : 20000;
+    n = select((ctl > chldpipe[0] ? ctl : chldpipe[0]) + 1, &fds, 0, 0,
+               draining ? &tv : 0);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      fatal(errno, "error calling select");
+    }
+    if(draining) {
+      /* the command has the terminal until it has read everything the
+       * parent sent.  If it's too quick for us to see any input queued then
+       * give it a few polls' grace. */
+      if(ioctl(0, FIONREAD, &queued) < 0)
+        fatal(errno, "error calling ioctl FIONREAD");
+      ++polls;
+      if(queued)
+        seen = 1;
+      else if(seen || polls >= 5) {
+        background();
+        draining = 0;
+      }
+    }
+    if(n > 0 && FD_ISSET(chldpipe[0], &fds)) {
+      read(chldpipe[0], &c, 1);
+      while((r = waitpid(child, &status, WUNTRACED|WNOHANG)) > 0) {
+        if(WIFSTOPPED(status)) {
+          if(WSTOPSIG(status) == SIGTTIN && !draining)
+            do_writen(ctl, "R", 1);
+        } else
+          mimic(status);
+      }
+    }
+    if(n > 0 && FD_ISSET(ctl, &fds)) {
+      if(read(ctl, &c, 1) <= 0) {
+        /* parent has gone; make sure the command notices */
+        forward(SIGHUP);
+        while((r = waitpid(child, &status, 0)) < 0 && errno == EINTR)
+          ;
+        mimic(r < 0 ? 0 : status);
+      }
+      if(c == 'G') {
+        if(tcsetpgrp(0, child) < 0)
+          fatal(errno, "error calling tcsetpgrp");
+        kill(-child, SIGCONT);
+        draining = 1;
+        seen = polls = 0;
+      }
+    }
+  }
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -79,6 +79,40 @@ void *xmalloc(size_t n) {
   return ptr;
 }
 
+/* write a string to fd */
+int do_writen(int fd, const char *s, size_t l) {
+  size_t m = 0;
+  int n;
+
+  while(m < l) {
+    n = write(fd, s + m, l - m);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return errno;
+    } else
+      m += n;
+  }
+  return 0;
+}
+
+/* read exactly n bytes from fd.  Returns 0 or an errno value; EOF is
+ * reported as EPIPE. */
+int do_readn(int fd, void *buf, size_t n) {
+  size_t m = 0;
+  ssize_t r;
+
+  while(m < n) {
+    r = read(fd, (char *)buf + m, n - m);
+    if(r < 0) {
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    if(!r) return EPIPE;
+    m += r;
+  }
+  return 0;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
@@ -27,13 +27,46 @@ static struct termios original_termios; /* original keyboard settings */
 static struct termios reading_termios;  /* in-use keyboard settings */
 
 static struct buffer input;             /* keyboard input */
-static struct buffer line;              /* latest line */
+static struct prompt line;              /* latest line */
 
 static char *histfile;                  /* path to history file */
 
+static int ttin_ctl = -1;               /* session shell control channel */
+static int child_waiting;               /* command is trying to read */
+static int reading;                     /* readline() is active */
+static struct timespec last_output;     /* when command last wrote */
+static long idle;                       /* --idle interval or 0 */
+static int redraw;                      /* Readline's line needs redrawing */
+static int known;                       /* latest line is a learned prompt */
+static int osc133;                      /* set to add OSC 133 marks */
+static int osc133_output;               /* OSC 133 output mark is open */
+static int prompt_timed;                /* first prompt has been seen */
+
+/* how long type-ahead is held, in --sigttin mode, after the command has
+ * gone quiet without asking for input */
+#define TTIN_PATIENCE 2000
+
 static const struct option options[] = {
   { "application", required_argument, 0, 'a' },
   { "history", required_argument, 0, 'H' },
+  { "pooled", no_argument, 0, 'p' },
+  { "pool-size", required_argument, 0, 'P' },
+  { "history-daemon", no_argument, 0, 'D' },
+  { "timing", optional_argument, 0, 'T' },
+  { "sigttin", no_argument, 0, 'S' },
+  { "idle", required_argument, 0, 'I' },
+  { "osc133", no_argument, 0, 'O' },
+  { "history-sync", required_argument, 0, 'Y' },
+  { "history-spool", required_argument, 0, 'W' },
+  { "history-control", required_argument, 0, 'C' },
+  { "shared-history", no_argument, 0, 'X' },
+  { "autosuggest", no_argument, 0, 'A' },
+  { "history-per-prompt", no_argument, 0, 'R' },
+  { "latency-report", no_argument, 0, 'L' },
+  { "history-tool", no_argument, 0, 'G' },
+  { "match", required_argument, 0, 'M' },
+  { "history-compress", no_argument, 0, 'Z' },
+  { "output-completion", no_argument, 0, 'K' },
   { "help", no_argument, 0, 'h' },
   { "version", no_argument, 0, 'V' },
   { 0, 0, 0, 0 }
@@ -43,9 +76,29 @@ static const struct option options[] = {
 static void help(void) {
   xprintf("Usage:\n"
 	  "  with-readline [OPTIONS] -- COMMAND ARGS...\n"
+	  "  with-readline --history-tool [OPTIONS] OUTPUT [INPUT...]\n"
 	  "Options:\n"
           "  --application APP, -a APP      Set application name\n"
           "  --history ENTRIES, -H ENTRIES  Maximum history to retain\n"
+          "  --pooled                       Adopt a pre-spawned command\n"
+          "  --pool-size N                  Spare commands to keep (default 1)\n"
+          "  --history-daemon               Share history via a daemon\n"
+          "  --timing[=FILE]                Report startup timings\n"
+          "  --sigttin                      Detect reads with SIGTTIN\n"
+          "  --idle MS                      Wait MS of silence for a prompt\n"
+          "  --osc133                       Mark prompts for the terminal\n"
+          "  --history-sync every|interval|exit\n"
+          "                                 When to write history\n"
+          "  --history-spool DIR            Write history via DIR\n"
+          "  --history-control LIST         Like Bash's HISTCONTROL\n"
+          "  --shared-history               See other sessions' history\n"
+          "  --autosuggest                  Suggest lines from history\n"
+          "  --history-per-prompt           Separate history for each prompt\n"
+          "  --latency-report               Report command latencies\n"
+          "  --history-tool                 Merge history files offline\n"
+          "  --match REGEXP                 History tool keeps only matches\n"
+          "  --history-compress             Write compressed history\n"
+          "  --output-completion            Complete words from output\n"
 	  "  --help, -h                     Display usage message\n"
 	  "  --version, -V                  Display version number\n");
   xfclose(stdout);
@@ -63,24 +116,27 @@ static void version(void) {
 }
 
 /* write a string to fd */
-static int do_writen(int fd, const char *s, size_t l) {
-  size_t m = 0;
-  int n;
+static int do_write(int fd, const char *s) {
+  return do_writen(fd, s, strlen(s));
+}
 
-  while(m < l) {
-    n = write(fd, s + m, l - m);
-    if(n < 0) {
-      if(errno == EINTR) continue;
-      return errno;
-    } else
-      m += n;
-  }
-  return 0;
+/* return the last component of path */
+static const char *base_name(const char *path) {
+  const char *s = strrchr(path, '/');
+
+  return s ? s + 1 : path;
 }
 
-/* write a string to fd */
-static int do_write(int fd, const char *s) {
-  return do_writen(fd, s, strlen(s));
+/* return the history file for app */
+static char *history_file(const char *app) {
+  const char *home;
+  char *path;
+
+  if(!(home = getenv("HOME")))
+    fatal(0, "HOME is not set");
+  path = xmalloc(strlen(home) + strlen(app) + 64);
+  sprintf(path, "%s/.%s_history", home, app);
+  return path;
 }
 
 /* dispose of setgid/setuid bit */
@@ -139,13 +195,113 @@ static void resize(void) {
   rl_resize_terminal();
 }
 
+/* process output from the command */
+static void child_output(const char *buf, size_t n) {
+  int err;
+
+  timing_mark("first output");
+  monotonic(&last_output);
+  if(reading && idle && !redraw) {
+    /* get Readline's line out of the way until the command goes quiet */
+    rl_clear_visible_line();
+    fflush(rl_outstream);
+    redraw = 1;
+  }
+  if((err = do_writen(1, buf, n)))
+    fatal(err, "error writing to master");
+  /* figure out the output line so far */
+  prompt_feed(&line, buf, n);
+  complete_feed(buf, n);
+  if(idle)
+    known = sigs_match(&line);
+}
+
+/* how many more milliseconds the command must be silent for its latest
+ * line to count as a prompt */
+static long unsettled(void) {
+  long left;
+
+  if(!idle || known || prompt_complete(&line)
+     || (left = idle - ms_since(&last_output)) < 0)
+    return 0;
+  return left;
+}
+
+/* true if the command's latest line is known to be a prompt */
+static int prompted(void) {
+  return child_waiting || prompt_complete(&line) || (idle && !unsettled());
+}
+
+/* for --timing, note when the command's first prompt is recognized */
+static void time_prompt(void) {
+  if(timing && !prompt_timed
+     && (child_waiting
+         || (line.text.start != line.text.end && prompted()))) {
+    timing_mark("first prompt");
+    prompt_timed = 1;
+  }
+}
+
+/* the command has gone quiet while Readline is active; redraw its line
+ * after the new prompt, or after the old one if there isn't a new one */
+static void settle(void) {
+  char *prompt;
+
+  redraw = 0;
+  if(line.text.start != line.text.end) {
+    prompt = prompt_get(&line);
+    sigs_learn(&line);
+    prompt_clear(&line);
+    known = 0;
+    rl_set_prompt(prompt);
+    free(prompt);
+    rl_on_new_line_with_prompt();
+  } else
+    rl_on_new_line();
+  rl_redisplay();
+}
+
+/* Wrap *promptp in OSC 133 marks.  The command has already printed the
+ * prompt, so we go back to the start of the line and have Readline print it
+ * again.  Returns 1 on success or 0 if the prompt is too wide for that to be
+ * safe. */
+static int mark_prompt(char **promptp, size_t width) {
+  int rows, cols;
+  char *p;
+
+  rl_get_screen_size(&rows, &cols);
+  if(width >= (size_t)cols)
+    return 0;
+  p = xmalloc(strlen(*promptp) + 64);
+  sprintf(p, "%s\001\033]133;A\007\002%s\001\033]133;B\007\002",
+          osc133_output ? "\001\033]133;D\007\002" : "", *promptp);
+  free(*promptp);
+  *promptp = p;
+  osc133_output = 0;
+  fputc('\r', rl_outstream);
+  return 1;
+}
+
+/* true if it's time to call readline() */
+static int want_line(void) {
+  if(ttin_ctl == -1)
+    return input.start != input.end && !unsettled();
+  if(child_waiting)
+    return 1;
+  /* hold type-ahead until the command wants it, unless it has been quiet
+   * for a while (in case we didn't notice it asking) */
+  return input.start != input.end
+    && ms_since(&last_output) >= TTIN_PATIENCE;
+}
+
 /* run an iteration of the event loop */
 static void eventloop(void) {
   fd_set fds;
   int max, n, err;
   unsigned char ch, sig;
-  const char *ptr;
   char buf[4096];
+  struct timeval tv, *timeout = 0;
+  long patience = -1, left;
 
   if(ptm == -1) return;
   
@@ -158,12 +314,45 @@ static void eventloop(void) {
   addfd(0);                             /* await input */
   addfd(ptm);                           /* to detect slaves closing */
   addfd(sigpipe[0]);
-  n = select(max + 1, &fds, 0, 0, 0);
+  /* pick up other sessions' history, but not while it's being edited */
+  if(share_watch() >= 0 && !reading)
+    addfd(share_watch());
+  if(ttin_ctl != -1) {
+    addfd(ttin_ctl);
+    /* wake up when we've held type-ahead for long enough */
+    if(!reading && !child_waiting && input.start != input.end) {
+      if((patience = TTIN_PATIENCE - ms_since(&last_output)) < 0)
+        patience = 0;
+    }
+  } else if(!reading && input.start != input.end && idle)
+    patience = unsettled();             /* wake up when the prompt settles */
+  if(redraw)
+    patience = unsettled();
+  /* wake up to time the first prompt when it settles */
+  if(timing && !prompt_timed && idle && (left = unsettled()) > 0
+     && (patience < 0 || left < patience))
+    patience = left;
+  /* wake up to record the latest line's latency */
+  if(!reading && (left = latency_check(&last_output, prompted())) >= 0) {
+    /* ...or when its prompt settles, if that's sooner */
+    if(idle && unsettled() && unsettled() < left)
+      left = unsettled();
+    if(patience < 0 || left < patience)
+      patience = left;
+  }
+  if(patience >= 0) {
+    tv.tv_sec = patience / 1000;
+    tv.tv_usec = patience % 1000 * 1000;
+    timeout = &tv;
+  }
+  n = select(max + 1, &fds, 0, 0, timeout);
   if(n < 0) {
     if(errno == EINTR)
       return;
     fatal(errno, "error calling select");
   }
+  if(redraw && !unsettled())
+    settle();
   if(FD_ISSET(0, &fds)) {
     /* Read a single character.  We could read many characters, parse out the
      * special characters, and dribble the remainder into readline, but we only
@@ -205,23 +394,23 @@ static void eventloop(void) {
       xclose(ptm);
       ptm = -1;
       return;
-    } else {
-      if((err = do_writen(1, buf, n)))
-        fatal(err, "error writing to master");
-      /* figure out the output line so far.  If there is a newline in the
-       * current input then it is the start of a new line; throw away the
-       * old line and start from just after it. */
-      for(ptr = buf + n; ptr > buf && ptr[-1] != '\n'; --ptr)
-        ;
-      if(ptr != buf) {
-        buffer_clear(&line);
-        n -= (ptr - buf);
-      }
-      buffer_append(&line, ptr, n);
-    }
+    } else
+      child_output(buf, n);
     /* the bytes read will be whatever we sent down ptm lately, we just
      * discard them */
   }
+  if(ttin_ctl != -1 && FD_ISSET(ttin_ctl, &fds)) {
+    n = read(ttin_ctl, &ch, 1);
+    if(n > 0) {
+      if(ch == 'R') child_waiting = 1;
+    } else if(n == 0 || errno != EINTR) {
+      /* the session shell has gone; the master will tell us why */
+      xclose(ttin_ctl);
+      ttin_ctl = -1;
+    }
+  }
+  if(share_watch() >= 0 && !reading && FD_ISSET(share_watch(), &fds))
+    share_event();
   if(FD_ISSET(sigpipe[0], &fds)) {
     n = read(sigpipe[0], &sig, 1);
     if(n < 0) {
@@ -249,8 +438,8 @@ static void eventloop(void) {
 }
 
 static int getc_callback(FILE attribute((unused)) *fp) {
-  /* wait until a character is available */
-  while(ptm != -1 && input.start == input.end)
+  /* wait until a character is available, and the line is visible */
+  while(ptm != -1 && (input.start == input.end || redraw))
     eventloop();
   if(ptm == -1) return EOF;
   return *input.start++;
@@ -288,18 +477,20 @@ static long convertnum(const char *s, long min, long max) {
 }
 
 int main(int argc, char **argv) {
-  int n, pts, p[2], err;
+  int n, p[2], ctl[2], err, pooled = 0, adopted = 0, use_histd = 0;
+  int ttin = 0, marked, sync = HISTW_SYNC_EVERY, shared = 0;
+  int autosuggest = 0, perprompt = 0, report = 0, tool = 0, complete = 0;
   char *ptspath, *prompt, *s;
+  const char *histpath;
   FILE *tty;
   struct winsize w;
+  struct buffer early;
   char buf[4096];
   pid_t pid, r;
   const char *app = 0;
-  struct stat sb;
-  struct group *g;
-  mode_t modemask;
-  const char *home, *histfilesize;
-  long maxhistory = 0;
+  const char *home, *histfilesize, *spooldir = 0, *histcontrol = 0;
+  const char *pattern = 0;
+  long maxhistory = 0, pool_size = 1, entries = 0;
 
   /* This is supposed to be a list of signals which by default terminate the
    * process.  Excluded are those that make a coredump, on the assumption that
@@ -323,6 +514,8 @@ int main(int argc, char **argv) {
     0
   };
 
+  timing_start();
+
   /* we might be setuid/setgid at this point */
 
   /* parse command line; initial '+' means not to reorder options */
@@ -333,14 +526,85 @@ int main(int argc, char **argv) {
       errno = 0;
       maxhistory = convertnum(optarg, 0, INT_MAX);
       break;
+    case 'p': pooled = 1; break;
+    case 'P': pool_size = convertnum(optarg, 1, 64); break;
+    case 'D': use_histd = 1; break;
+    case 'T': timing = 1; timing_file = optarg; break;
+    case 'S': ttin = 1; break;
+    case 'I': idle = convertnum(optarg, 1, 60000); break;
+    case 'O': osc133 = 1; break;
+    case 'Y':
+      if(!strcmp(optarg, "every")) sync = HISTW_SYNC_EVERY;
+      else if(!strcmp(optarg, "interval")) sync = HISTW_SYNC_INTERVAL;
+      else if(!strcmp(optarg, "exit")) sync = HISTW_SYNC_EXIT;
+      else fatal(0, "unknown history sync policy '%s'", optarg);
+      break;
+    case 'W': spooldir = optarg; break;
+    case 'C': histcontrol = optarg; break;
+    case 'X': shared = 1; break;
+    case 'A': autosuggest = 1; break;
+    case 'K': complete = 1; break;
+    case 'R': perprompt = 1; break;
+    case 'L': report = 1; break;
+    case 'G': tool = 1; break;
+    case 'M': pattern = optarg; break;
+    case 'Z':
+#if HAVE_ZLIB_H
+      history_compress = 1;
+#else
+      fatal(0, "--history-compress needs zlib");
+#endif
+      break;
     case 'h': help();
     case 'V': version();
     default: fatal(0, "invalid option");
     }
   }
+  if(tool) {
+    /* with no inputs, just compact the output file */
+    if(optind == argc) fatal(0, "no history file specified");
+    surrender_privilege();
+    if(histcontrol)
+      hist_control_parse(histcontrol);
+    history_tool(argv[optind],
+                 optind + 1 < argc ? &argv[optind + 1] : &argv[optind],
+                 optind + 1 < argc ? argc - optind - 1 : 1,
+                 pattern, hist_control & HC_ERASEDUPS, maxhistory);
+    exit(0);
+  }
+  if(report) {
+    /* no need for a command if we know the application */
+    if(!app && optind == argc) fatal(0, "no command specified");
+    surrender_privilege();
+    latency_report(history_file(app ? app : base_name(argv[optind])));
+    exit(0);
+  }
   if(optind == argc) fatal(0, "no command specified");
+  if(perprompt && shared)
+    fatal(0, "--history-per-prompt and --shared-history are incompatible");
+  /* histories that are dropped from memory are read back from their files,
+   * so lines have to be in the files by then */
+  if(perprompt && (sync != HISTW_SYNC_EVERY || spooldir))
+    fatal(0, "--history-per-prompt needs --history-sync every"
+          " and no --history-spool");
+  timing_mark("options");
   /* if stdin is not a tty then just go straight to the command */
   if(isatty(0)) {
+    /* get old terminal settings; later on we'll apply these to the subsiduary
+     * terminal */
+    if(tcgetattr(0, &original_termios) < 0)
+      fatal(errno, "error calling tcgetattr");
+    if(ioctl(0, TIOCGWINSZ, &w) < 0)
+      fatal(errno, "error calling ioctl TIOCGWINSZ");
+    if(pooled) {
+      /* the broker runs as the user, so there's no point holding on to
+       * privilege to talk to it */
+      surrender_privilege();
+      buffer_init(&early);
+      adopted = pool_adopt(&argv[optind], pool_size, &original_termios, &w,
+                           &ptm, &pid, &early);
+      timing_mark("pool_adopt");
+    }
     /* Create the terminal
      *
      * Why use a pseudo-terminal and not a pipe?  Some programs vary their
@@ -348,20 +612,17 @@ int main(int argc, char **argv) {
      * not, and when you're addressing a program from the keyboard you probably
      * wanted the terminal behaviour.
      */
-    make_terminal(&ptm, &ptspath);
+    if(!adopted) {
+      make_terminal(&ptm, &ptspath);
+      timing_mark("make_terminal");
+    }
     surrender_privilege();
     /* set app name for Readline */
-    if(!app) {
-      if((app = strrchr(argv[optind], '/'))) ++app;
-      else app = argv[optind];
-    }
+    if(!app)
+      app = base_name(argv[optind]);
     /* read in saved history */
-    if(!(home = getenv("HOME")))
-      fatal(0, "HOME is not set");
-    histfile = xmalloc(strlen(home) + strlen(app) + 64);
-    sprintf(histfile, "%s/.%s_history", home, app);
-    if((err = read_history(histfile)) && errno != ENOENT)
-      fatal(err, "error reading %s", histfile);
+    histfile = history_file(app);
+    home = getenv("HOME");
     if(maxhistory == 0) {
       /* determine default history file size the same way GNU Bash does */
       if((histfilesize = getenv("HISTFILESIZE")))
@@ -369,12 +630,63 @@ int main(int argc, char **argv) {
       else
         maxhistory = 500;
     }
-    stifle_history(maxhistory);
-    /* write the history back out, thus making sure it exists (necessary for
-     * append_history() to work */
-    if((err = write_history(histfile)))
-      fatal(errno, "error writing %s", histfile);
+    /* each prompt's history is loaded when the prompt is first seen, and
+     * the daemon only knows about the one file, in plain text */
+    if(history_compress)
+      use_histd = 0;
+    if(perprompt) {
+      ctx_start(histfile, maxhistory);
+      use_histd = 0;
+    }
+    /* the daemon has probably parsed it already (and looks after trimming
+     * the file) */
+    else if(use_histd && histd_load(histfile, maxhistory))
+      use_histd = 1;
+    else {
+      use_histd = 0;
+      entries = history_load(histfile, maxhistory);
+    }
+    timing_mark("read_history");
+    /* get history writes off the interactive path */
+    if(!use_histd) {
+      histw_start(sync, spooldir);
+      timing_mark("histw_start");
+    }
+    if(idle) {
+      /* prompts we've learned to recognize without waiting */
+      s = xmalloc(strlen(home) + strlen(app) + 64);
+      sprintf(s, "%s/.%s_prompts", home, app);
+      sigs_load(s);
+      free(s);
+    }
+    /* Bash's HISTCONTROL is a reasonable default, as for HISTFILESIZE */
+    if(histcontrol || (histcontrol = getenv("HISTCONTROL")))
+      hist_control_parse(histcontrol);
+    hist_index();
+    hist_limit(maxhistory);
+    if(autosuggest)
+      suggest_start();
+    if(complete)
+      complete_start();
+    /* words to complete, if the user has provided any */
+    s = xmalloc(strlen(home) + strlen(app) + 64);
+    sprintf(s, "%s/.%s_words", home, app);
+    if(words_open(s))
+      complete_bind();
+    free(s);
+    timing_mark("words_open");
+    if(shared)
+      share_start(histfile);
+    /* appending makes the file grow; only rewrite it when it has grown well
+     * past the limit, rather than every time, and not while we wait */
+    if(entries > maxhistory + HISTORY_SLACK(maxhistory)) {
+      compact_start(histfile, maxhistory, hist_control & HC_ERASEDUPS);
+      timing_mark("compact_start");
+    }
     rl_readline_name = app;
+    /* if Readline has to write history itself, it should include
+     * timestamps as we do */
+    history_write_timestamps = 1;
     /* we'll have our own signal handlers */
     rl_catch_signals = 0;
     rl_catch_sigwinch = 0;
@@ -389,145 +701,169 @@ int main(int argc, char **argv) {
      * from the keyboard, but it might nonetheless be sent via kill(2). */
     for(n = 0; fatal_signals[n]; ++n)
       catch_signal(fatal_signals[n], 0);
-    /* get old terminal settings; later on we'll apply these to the subsiduary
-     * terminal */
-    if(tcgetattr(0, &original_termios) < 0)
-      fatal(errno, "error calling tcgetattr");
-    if(ioctl(0, TIOCGWINSZ, &w) < 0)
-      fatal(errno, "error calling ioctl TIOCGWINSZ");
-    /* the child will tell the parent that it has completed initialiazation by
-     * closing the this pipe.  The idea is to ensure if we read the master and
-     * get eof, this is because the last slave was closed, not because it
-     * hasn't been opened yet. */
-    if(pipe(p) < 0) fatal(errno, "error creating pipe");
-    switch(pid = fork()) {
-    case -1: fatal(errno, "error calling fork");
-
-      /* parent */
-    default:
+    timing_mark("signals");
+    if(adopted) {
+      /* the child is already running; just show what it's said so far */
+      child_output(early.start, early.end - early.start);
+      free(early.base);
+    } else {
+      /* the child will tell the parent that it has completed initialiazation
+       * by closing the this pipe.  The idea is to ensure if we read the master
+       * and get eof, this is because the last slave was closed, not because
+       * it hasn't been opened yet. */
+      if(pipe(p) < 0) fatal(errno, "error creating pipe");
+      if(ttin && socketpair(PF_UNIX, SOCK_STREAM, 0, ctl) < 0)
+        fatal(errno, "error calling socketpair");
+      switch(pid = fork()) {
+      case -1: fatal(errno, "error calling fork");
+      case 0:
+        xclose(ptm);
+        setup_child(ptspath, &original_termios, &w);
+        /* signal to parent that we have opened the slave */
+        xclose(p[0]);
+        xclose(p[1]);
+        /* close stuff we don't need */
+        xclose(sigpipe[0]);
+        xclose(sigpipe[1]);
+        if(ttin) {
+          /* interpose a session shell; see design.txt */
+          xclose(ctl[0]);
+          ttin_shell(ctl[1], &argv[optind]);
+        }
+        execvp(argv[optind], &argv[optind]);
+        fatal(errno, "error executing %s", argv[optind]);
+      }
+      timing_mark("fork");
       /* wait for child to open slave */
       xclose(p[1]);
       read(p[0], buf, 1);
       xclose(p[0]);
-      /* we always echo input to /dev/tty rather than whatever stdout or stderr
-       * happen to be at the moment (it would be better to guarantee to use the
-       * same terminal as stdin) */
-      if(!(tty = fopen("/dev/tty", "r+")))
-        fatal(errno, "error opening /dev/tty");
-      rl_instream = stdin;              /* needed by rl_prep_terminal */
-      rl_outstream = tty;
-      rl_prep_terminal(1);              /* want key at a time mode always */
-      /* disable INTR and QUIT, since we want to pass them through the pty. */
-      if(tcgetattr(0, &reading_termios) < 0)
-        fatal(errno, "error calling tcgetattr");
-      reading_termios.c_cc[VINTR] = reading_termios.c_cc[VQUIT] = 0;
-      if(tcsetattr(0, TCSANOW, &reading_termios) < 0)
-        fatal(errno, "error calling tcsetattr");
-      /* stop readline from fiddling with terminal settings.  Readline
-       * documentation suggests we can set these to 0, but it is a lying toad:
-       * this is not so (at least in 4.3).  */
-      rl_prep_term_function = prep_nop;
-      rl_deprep_term_function = deprep_nop;
-      /* replace rl_getc with our own function for fine-grained control over
-       * input */
-      rl_getc_function = getc_callback;
-      rl_initialize();
-      while(ptm != -1) {
-        eventloop();                    /* wait for something to happen */
-        if(input.start != input.end) {
-          /* there is input.  We copy the prompt since line might be modified
-           * while still reading. */
-          if(!(prompt = malloc(line.end - line.start + 1)))
-            fatal(errno, "error calling malloc");
-          memcpy(prompt, line.start, line.end - line.start);
-          prompt[line.end - line.start] = 0;
-          buffer_clear(&line);          /* zap the saved line */
-          rl_already_prompted = 1;      /* command already printed prompt */
-          s = readline(prompt);         /* get a line */
-          free(prompt);
-          if(!s) {
-            /* send an EOF */
-            if((err = do_writen(ptm, (char *)&original_termios.c_cc[VEOF], 1)))
-              fatal(err, "error writing to pty master");
-          } else {
-            if(*s) {
-              add_history(s);
-              append_history(1, histfile);
-              /* currently we ignore errors writing the history */
-            }
-            /* pass input to slave reader */
-            if((err = do_write(ptm, s))
-               || (err = do_write(ptm, "\r")))
-              fatal(err, "error writing to pty master");
-            free(s);
+      timing_mark("handshake");
+      if(ttin) {
+        xclose(ctl[1]);
+        ttin_ctl = ctl[0];
+      }
+      /* the command has said nothing yet; start being patient now */
+      monotonic(&last_output);
+    }
+    /* we always echo input to /dev/tty rather than whatever stdout or stderr
+     * happen to be at the moment (it would be better to guarantee to use the
+     * same terminal as stdin) */
+    if(!(tty = fopen("/dev/tty", "r+")))
+      fatal(errno, "error opening /dev/tty");
+    rl_instream = stdin;                /* needed by rl_prep_terminal */
+    rl_outstream = tty;
+    rl_prep_terminal(1);                /* want key at a time mode always */
+    /* disable INTR and QUIT, since we want to pass them through the pty. */
+    if(tcgetattr(0, &reading_termios) < 0)
+      fatal(errno, "error calling tcgetattr");
+    reading_termios.c_cc[VINTR] = reading_termios.c_cc[VQUIT] = 0;
+    if(tcsetattr(0, TCSANOW, &reading_termios) < 0)
+      fatal(errno, "error calling tcsetattr");
+    /* stop readline from fiddling with terminal settings.  Readline
+     * documentation suggests we can set these to 0, but it is a lying toad:
+     * this is not so (at least in 4.3).  */
+    rl_prep_term_function = prep_nop;
+    rl_deprep_term_function = deprep_nop;
+    /* replace rl_getc with our own function for fine-grained control over
+     * input */
+    rl_getc_function = getc_callback;
+    search_bind();
+    fuzzy_bind();
+    rl_initialize();
+    suggest_bind();
+    timing_mark("rl_initialize");
+    histpath = histfile;
+    while(ptm != -1) {
+      eventloop();                      /* wait for something to happen */
+      time_prompt();
+      if(want_line()) {
+        /* the previous line's latency is known now */
+        latency_prompt(&last_output);
+        /* without inotify, catch up with other sessions before each line */
+        if(share_watch() < 0)
+          share_poll();
+        /* there is input (or the command wants some).  We copy the prompt
+         * since line might be modified while still reading. */
+        prompt = prompt_get(&line);
+        /* if the command marks its own prompts, the terminal has seen them */
+        marked = osc133 && !prompt_marked(&line)
+          && mark_prompt(&prompt, prompt_width(&line));
+        if(idle)
+          sigs_learn(&line);
+        if(perprompt) {
+          s = sigs_signature(&line);
+          histpath = ctx_switch(s);
+          free(s);
+        }
+        prompt_clear(&line);            /* zap the saved line */
+        known = 0;
+        rl_already_prompted = !marked;  /* command already printed prompt */
+        prompt_timed = 1;               /* too late to time it now */
+        reading = 1;
+        s = readline(prompt);           /* get a line */
+        reading = 0;
+        free(prompt);
+        if(ptm == -1) {
+          /* the command went away while we were reading */
+          free(s);
+          break;
+        }
+        if(marked) {
+          /* whatever follows is the command's output */
+          fputs("\033]133;C\007", rl_outstream);
+          fflush(rl_outstream);
+          osc133_output = 1;
+        }
+        if(!s) {
+          /* send an EOF */
+          if((err = do_writen(ptm, (char *)&original_termios.c_cc[VEOF], 1)))
+            fatal(err, "error writing to pty master");
+        } else {
+          if(*s && hist_add(s)) {
+            share_sent(s);
+            latency_sent(histpath, s);
           }
-          rl_line_buffer[0] = '\0';
-          rl_point = rl_mark = rl_end = 0;
-          rl_free_undo_list();
+          /* pass input to slave reader */
+          if((err = do_write(ptm, s))
+             || (err = do_write(ptm, "\r")))
+            fatal(err, "error writing to pty master");
+          free(s);
         }
+        if(ttin_ctl != -1) {
+          /* let the command have what we just sent */
+          child_waiting = 0;
+          if((err = do_writen(ttin_ctl, "G", 1)))
+            fatal(err, "error writing to session shell");
+        }
+        rl_line_buffer[0] = '\0';
+        rl_point = rl_mark = rl_end = 0;
+        rl_free_undo_list();
       }
-      if(tcsetattr(0, TCSANOW, &original_termios) < 0)
-        fatal(errno, "error calling tcsetattr");
-      /* wait for the child to terminate so we can return its exit status */
+    }
+    if(tcsetattr(0, TCSANOW, &original_termios) < 0)
+      fatal(errno, "error calling tcsetattr");
+    /* wait for the child to terminate so we can return its exit status */
+    if(adopted)
+      n = pool_wait();
+    else {
       while((r = waitpid(pid, &n, 0)) < 0 && errno == EINTR)
         ;
       if(r < 0) fatal(errno, "error calling waitpid");
-      if(WIFEXITED(n))
-        exit(WEXITSTATUS(n));
-      if(WIFSIGNALED(n)) {
-        fprintf(stderr, "%s: %s%s\n",
-                argv[optind], strsignal(WTERMSIG(n)),
-                WCOREDUMP(n) ? " (core dumped)" : "");
-        exit(128 + WTERMSIG(n));
-      }
-      fatal(0, "cannot parse wait status %#x", (unsigned)n);
-
-      /* child */
-    case 0:
-      exitfn = _exit;
-      xclose(ptm);
-      if(setsid() < 0)
-        fatal(errno, "error calling setsid");
-      if((pts = open(ptspath, O_RDWR, 0)) < 0)
-        fatal(errno, "opening %s", ptspath);
-#ifdef TIOCSCTTY
-      if(ioctl(pts, TIOCSCTTY) < 0)
-        fatal(errno, "error calling ioctl TIOCSCTTY");
-#endif
-      /* check that the terminal has sensible permissions */
-      if(fstat(pts, &sb) < 0) fatal(errno, "error calling fstat on %s",
-                                    ptspath);
-      /* group tty write is ok - used by write(1) and similar programs
-       * group anything else write is not safe however.
-       * group read is bad - shoulnd't give those programs excess privilege
-       * world read or write is very bad!
-       */
-      if((g = getgrnam("tty")) && sb.st_gid == g->gr_gid) modemask = 057;
-      else modemask = 077;
-      if(sb.st_mode & modemask)
-        fatal(0, "%s has insecure mode %#lo",
-              ptspath, (unsigned long)sb.st_mode);
-      if(sb.st_uid != getuid())
-        fatal(0, "%s has owner %lu, but we are running as UID %lu",
-              ptspath, (unsigned long)sb.st_uid, (unsigned long)getuid());
-      /* signal to parent that we have opened the slave */
-      xclose(p[0]);
-      xclose(p[1]);
-      /* close stuff we don't need */
-      xclose(sigpipe[0]);
-      xclose(sigpipe[1]);
-      if(pts != 0 && dup2(pts, 0) < 0) fatal(errno, "error calling dup2");
-      if(pts != 1 && dup2(pts, 1) < 0) fatal(errno, "error calling dup2");
-      if(pts != 2 && dup2(pts, 2) < 0) fatal(errno, "error calling dup2");
-      if(pts > 2) xclose(pts);
-      if(ioctl(0, TIOCSWINSZ, &w) < 0)
-        fatal(errno, "error calling ioctl TIOSGWINSZ");
-      original_termios.c_lflag &= ~ECHO;
-      if(tcsetattr(0, TCSANOW, &original_termios) < 0)
-        fatal(errno, "error calling tcsetattr");
-      /* fall through to execution */
-      break;
     }
+    latency_finish();
+    sigs_save();
+    histw_finish();
+    timing_report(argv[optind]);
+    if(WIFEXITED(n))
+      exit(WEXITSTATUS(n));
+    if(WIFSIGNALED(n)) {
+      fprintf(stderr, "%s: %s%s\n",
+              argv[optind], strsignal(WTERMSIG(n)),
+              WCOREDUMP(n) ? " (core dumped)" : "");
+      exit(128 + WTERMSIG(n));
+    }
+    fatal(0, "cannot parse wait status %#x", (unsigned)n);
   } else
     surrender_privilege();
   execvp(argv[optind], &argv[optind]);
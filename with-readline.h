@@ -53,7 +53,12 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <grp.h>
+#include <stdint.h>
+#include <time.h>
 #include <termios.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -76,7 +81,23 @@ extern void (*exitfn)(int) attribute((noreturn));
 
 extern int debugging;
 
+int do_writen(int fd, const char *s, size_t l);
+int do_readn(int fd, void *buf, size_t n);
+
 void make_terminal(int *ptmp, char **slavep);
+void setup_child(const char *ptspath, const struct termios *t,
+                 const struct winsize *w);
+
+const char *rundir(void);
+int unix_connect(const char *path);
+int unix_listen(const char *path);
+int send_all(int sock, const void *buf, size_t n);
+int send_fd(int sock, int fd, const void *buf, size_t n);
+int recv_fd(int sock, int *fdp, void *buf, size_t n);
+void cloexec(int fd);
+void nonblock(int fd);
+int daemonize(void);
+uint64_t hash_string(uint64_t h, const char *s, size_t n);
 
 #ifndef WCOREDUMP
 # define WCOREDUMP(W) ((W) & 0x80)
@@ -86,6 +107,10 @@ void make_terminal(int *ptmp, char **slavep);
 const char *strsignal(int);
 #endif
 
+#if ! HAVE_MEMRCHR
+void *memrchr(const void *s, int c, size_t n);
+#endif
+
 struct buffer {
   char *base, *start, *end, *top;
 };
@@ -93,9 +118,153 @@ struct buffer {
 void buffer_init(struct buffer *b);
 void buffer_append(struct buffer *b, const void *ptr, size_t n);
 void buffer_clear(struct buffer *b);
+void buffer_keep(struct buffer *b, size_t n);
 
 int buffer_write(struct buffer *b, int fd);
 
+int pool_adopt(char **argv, int size, const struct termios *t,
+               const struct winsize *w, int *ptmp, pid_t *pidp,
+               struct buffer *output);
+int pool_wait(void);
+
+#define PROMPT_MAX 1024                 /* longest prompt we'll track */
+
+/* the latest line of output from the command; all-bits-0 is a valid empty
+ * prompt */
+struct prompt {
+  struct buffer text;                   /* line so far, with ignore markers */
+  struct buffer seq;                    /* incomplete escape sequence */
+  int state;                            /* parser state */
+  size_t width;                         /* visible width of text */
+  int marked;                           /* command sends OSC 133 marks */
+  int complete;                         /* end-of-prompt mark seen */
+};
+
+void prompt_feed(struct prompt *p, const char *buf, size_t n);
+void prompt_clear(struct prompt *p);
+char *prompt_get(const struct prompt *p);
+size_t prompt_width(const struct prompt *p);
+int prompt_marked(const struct prompt *p);
+int prompt_complete(const struct prompt *p);
+
+void sigs_load(const char *path);
+void sigs_save(void);
+int sigs_match(const struct prompt *p);
+void sigs_learn(const struct prompt *p);
+char *sigs_signature(const struct prompt *p);
+
+/* how far past the limit history files may grow before being trimmed */
+#define HISTORY_SLACK(max) ((max) / 4)
+
+enum {
+  HISTW_SYNC_EVERY,                     /* write each line as it arrives */
+  HISTW_SYNC_INTERVAL,                  /* write every few seconds */
+  HISTW_SYNC_EXIT                       /* write at exit */
+};
+
+void histw_start(int policy, const char *spooldir);
+int histw_append(const char *path, const char *data, size_t n);
+void histw_finish(void);
+
+#define HC_IGNOREDUPS 1                 /* don't repeat the last line */
+#define HC_IGNORESPACE 2                /* don't save lines starting ' ' */
+#define HC_ERASEDUPS 4                  /* only keep the latest of a line */
+
+extern int hist_control;
+
+void hist_control_parse(const char *s);
+void hist_limit(long max);
+void hist_index(void);
+int hist_add(const char *line);
+long hist_position(long serial);
+long hist_serial(long pos);
+struct hist_state *hist_save(void);
+void hist_restore(struct hist_state *hs);
+void hist_discard(struct hist_state *hs);
+
+void search_add(const char *line, long serial);
+void search_forget(long serial);
+void search_begin(void);
+long search_narrow(int c, int direction);
+long search_widen(void);
+long search_next(int direction);
+void search_bind(void);
+struct search_state *search_save(void);
+void search_restore(struct search_state *ss);
+void search_discard(struct search_state *ss);
+
+void fuzzy_begin(void);
+size_t fuzzy_narrow(int c);
+size_t fuzzy_widen(void);
+const char *fuzzy_result(size_t n);
+void fuzzy_bind(void);
+
+void suggest_add(const char *line, long serial);
+void suggest_forget(long serial);
+const char *suggest_lookup(const char *s);
+void suggest_index(void);
+void suggest_start(void);
+void suggest_bind(void);
+struct suggest_state *suggest_save(void);
+void suggest_restore(struct suggest_state *ss);
+void suggest_discard(struct suggest_state *ss);
+
+void complete_feed(const char *buf, size_t n);
+void complete_start(void);
+void complete_bind(void);
+
+int words_open(const char *path);
+const char *words_at(size_t n);
+size_t words_find(const char *prefix, size_t *firstp);
+
+void share_start(const char *path);
+int share_watch(void);
+void share_sent(const char *line);
+void share_poll(void);
+void share_event(void);
+
+int history_open_append(const char *path);
+void compact_start(const char *path, long max, int erasedups);
+
+int history_map(const char *path, long max, long limit, long *entriesp);
+long history_load(const char *path, long max);
+
+extern int history_compress;
+
+int history_plain(const char *data, size_t n);
+size_t history_decode(const char *data, size_t n,
+                      void (*fn)(void *u, const char *s, size_t n),
+                      void *u);
+size_t history_decode_text(const char *data, size_t n, struct buffer *b);
+void history_encode(const char *data, size_t n, struct buffer *out);
+
+void ctx_start(const char *histfile, long maxhistory);
+const char *ctx_switch(const char *sig);
+
+int histd_load(const char *histfile, long max);
+int histd_append(const char *ts, const char *line);
+
+void latency_sent(const char *path, const char *line);
+void latency_prompt(const struct timespec *last_output);
+long latency_check(const struct timespec *last_output, int prompted);
+void latency_finish(void);
+void latency_report(const char *path);
+
+void history_tool(const char *output, char **paths, int npaths,
+                  const char *pattern, int erasedups, long max);
+
+extern int timing;
+extern const char *timing_file;
+
+void timing_start(void);
+void timing_mark(const char *phase);
+void timing_report(const char *command);
+void timing_count(const char *what, unsigned long n);
+void monotonic(struct timespec *ts);
+long ms_since(const struct timespec *ts);
+
+void ttin_shell(int ctl, char **argv) attribute((noreturn));
+
 #endif /* WITH_READLINE_H */
 
 /*
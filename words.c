@@ -0,0 +1,260 @@
+/*
+ * This file is part of with-readline.
+ * Copyright (C) 2005 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "with-readline.h"
+#include <sys/mman.h>
+#include <ctype.h>
+
+/* Completion dictionaries.
+ *
+ * An application's word list, one word per line, is compiled into an index
+ * next to it the first time it's needed and whenever the list changes.
+ * The index is mapped read-only, so however many sessions use it they share
+ * one copy in the page cache, and nothing is parsed at startup.
+ *
+ * The index is a header, then the offset of each word from the start of
+ * the file, then the words themselves in sorted order, each followed by a
+ * 0 byte.  The header says where the words starting with each byte begin,
+ * so a prefix is looked up by a binary search of just those.  Numbers are
+ * in the host's byte order; the index is only a cache of the word list and
+ * is rebuilt if it doesn't look right.
+ *
+ * The header also records the size and modification time of the word list
+ * it was compiled from, and it's out of date if they've changed.  Comparing
+ * the two files' times instead would leave an index written in the same
+ * second as its list looking out of date for ever.
+ */
+
+#define WORDS_MAGIC "wrwords2"
+
+struct header {
+  char magic[8];                        /* WORDS_MAGIC */
+  uint64_t size;                        /* word list's size */
+  int64_t mtime, mtime_ns;              /* ...and modification time */
+  uint32_t count;                       /* number of words */
+  uint32_t first[257];                  /* first word starting with >= byte */
+};
+
+static const char *map;                 /* mapped index */
+static size_t size;                     /* its size */
+static const struct header *header;     /* null if there's no dictionary */
+static const uint32_t *offsets;
+
+/* record the size and modification time of the word list in h */
+static void stamp(struct header *h, const struct stat *sb) {
+  h->size = sb->st_size;
+  h->mtime = sb->st_mtime;
+#if HAVE_STRUCT_STAT_ST_MTIM
+  h->mtime_ns = sb->st_mtim.tv_nsec;
+#else
+  h->mtime_ns = 0;
+#endif
+}
+
+/* true if h was compiled from the word list that sb describes */
+static int compiled_from(const struct header *h, const struct stat *sb) {
+  struct header want;
+
+  stamp(&want, sb);
+  return h->size == want.size && h->mtime == want.mtime
+    && h->mtime_ns == want.mtime_ns;
+}
+
+static int compare_word(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Compile the word list at path into index.  Errors are ignored; there
+ * will just be no dictionary. */
+static void compile(const char *path, const char *index) {
+  struct header h;
+  struct stat sb;
+  FILE *fp;
+  char *l = 0, *s, *tmp, **words = 0;
+  size_t n = 0, nwords = 0, nslots = 0, i, j;
+  ssize_t len;
+  uint64_t offset;
+  uint32_t o;
+  int b, bad = 0;
+
+  if(!(fp = fopen(path, "r")))
+    return;
+  memset(&h, 0, sizeof h);
+  if(fstat(fileno(fp), &sb) < 0) {
+    fclose(fp);
+    return;
+  }
+  stamp(&h, &sb);
+  while((len = getline(&l, &n, fp)) >= 0) {
+    while(len && isspace((unsigned char)l[len - 1]))
+      l[--len] = 0;
+    for(s = l; isspace((unsigned char)*s); ++s)
+      ;
+    if(!*s || *s == '#')
+      continue;
+    if(nwords == nslots) {
+      nslots = nslots ? 2 * nslots : 1024;
+      words = xrealloc(words, nslots * sizeof *words);
+    }
+    words[nwords++] = xstrdup(s);
+  }
+  free(l);
+  fclose(fp);
+  qsort(words, nwords, sizeof *words, compare_word);
+  for(i = j = 0; i < nwords; ++i)
+    if(j && !strcmp(words[i], words[j - 1]))
+      free(words[i]);
+    else
+      words[j++] = words[i];
+  nwords = j;
+  memcpy(h.magic, WORDS_MAGIC, sizeof h.magic);
+  h.count = nwords;
+  for(b = j = 0; b <= 256; ++b) {
+    while(j < nwords && (unsigned char)words[j][0] < b)
+      ++j;
+    h.first[b] = j;
+  }
+  tmp = xmalloc(strlen(index) + 32);
+  sprintf(tmp, "%s.%lu", index, (unsigned long)getpid());
+  if((fp = fopen(tmp, "w"))) {
+    if(fwrite(&h, sizeof h, 1, fp) != 1)
+      bad = 1;
+    offset = sizeof h + (uint64_t)nwords * sizeof o;
+    for(i = 0; i < nwords && !bad; ++i) {
+      o = offset;
+      if(offset > UINT32_MAX || fwrite(&o, sizeof o, 1, fp) != 1)
+        bad = 1;
+      offset += strlen(words[i]) + 1;
+    }
+    for(i = 0; i < nwords && !bad; ++i)
+      if(fwrite(words[i], strlen(words[i]) + 1, 1, fp) != 1)
+        bad = 1;
+    if(fclose(fp) < 0 || bad || rename(tmp, index) < 0)
+      unlink(tmp);
+  }
+  free(tmp);
+  for(i = 0; i < nwords; ++i)
+    free(words[i]);
+  free(words);
+}
+
+/* map index, returning nonzero if it looks right and, if text isn't a null
+ * pointer, was compiled from the word list text describes */
+static int map_index(const char *index, const struct stat *text) {
+  const struct header *h;
+  struct stat sb;
+  void *m;
+  int fd;
+
+  if((fd = open(index, O_RDONLY)) < 0)
+    return 0;
+  if(fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof *h
+     || (m = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0))
+        == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  xclose(fd);
+  h = m;
+  if(memcmp(h->magic, WORDS_MAGIC, sizeof h->magic)
+     || h->first[256] != h->count
+     || (sb.st_size - sizeof *h) / sizeof *offsets < h->count
+     || ((const char *)m)[sb.st_size - 1]
+     || (text && !compiled_from(h, text))) {
+    munmap(m, sb.st_size);
+    return 0;
+  }
+  map = m;
+  size = sb.st_size;
+  header = h;
+  offsets = (const uint32_t *)(h + 1);
+  return 1;
+}
+
+/* Use the word list at path, if there is one, compiling it first if
+ * necessary.  Returns nonzero if there's a dictionary. */
+int words_open(const char *path) {
+  struct stat text;
+  char *index;
+  int ok;
+
+  if(stat(path, &text) < 0)
+    return 0;
+  index = xmalloc(strlen(path) + 8);
+  sprintf(index, "%s.idx", path);
+  if(!(ok = map_index(index, &text))) {
+    compile(path, index);
+    /* if the list changed again meanwhile, use it anyway this time */
+    ok = map_index(index, 0);
+  }
+  free(index);
+  return ok;
+}
+
+/* return word n */
+const char *words_at(size_t n) {
+  /* the index ends with a 0 byte, so anything inside it is terminated */
+  return offsets[n] < size ? map + offsets[n] : "";
+}
+
+/* Find the words starting with prefix.  Returns how many there are, and
+ * sets *firstp to the first of them. */
+size_t words_find(const char *prefix, size_t *firstp) {
+  size_t lo, hi, mid, start, len = strlen(prefix);
+  unsigned char b = *prefix;
+
+  if(!header)
+    return 0;
+  if(!b) {
+    *firstp = 0;
+    return header->count;
+  }
+  lo = header->first[b];
+  hi = header->first[b + 1];
+  if(lo > hi || hi > header->count)
+    return 0;
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(strcmp(words_at(mid), prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  start = lo;
+  hi = header->first[b + 1];
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(!strncmp(words_at(mid), prefix, len))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *firstp = start;
+  return lo - start;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/